@@ -0,0 +1,383 @@
+// bench_myshell - launch latency and pipeline throughput benchmarks for myshell
+//
+// Build:  gcc -O2 -Wall -o bench_myshell bench_myshell.c
+// Run:    ./bench_myshell [-s ./myshell] [-n launches] [-m payload_mb] [-j jobs] [-f csv|json] [-o file]
+//
+// myshell is driven non-interactively with generated scripts. Per-command
+// numbers come from its MYSHELL_STATS_LOG (one JSON object per finished job,
+// "real" is measured from before the launch until the job is reaped):
+//   launch     latency percentiles of plain, redirected and piped commands,
+//              for every spawn backend
+//   pathlookup latency of a command right after "hash -r" with N missing
+//              directories in front of PATH
+//   pipeline   MB/s through 2- and 4-stage cat pipelines
+//   fanout     background jobs started and reaped per second
+// Every result is one row: benchmark, spawn, param, metric, value, unit.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <errno.h>
+
+#define MAX_RESULTS 256
+
+typedef struct {
+    char benchmark[32];
+    char spawn[16];
+    char param[48];
+    char metric[16];
+    double value;
+    const char *unit;
+} Result;
+
+typedef struct {
+    double real;        // seconds
+    double start;       // wall clock seconds
+} Sample;
+
+Result results[MAX_RESULTS];
+int result_count = 0;
+
+char *shell_path = "./myshell";
+char temp_dir[] = "/tmp/bench_myshell.XXXXXX";
+char script_path[256];
+char log_path[256];
+
+const char *spawn_modes[] = { "fork", "vfork", "posix_spawn", "zygote" };
+
+void add_result(const char *benchmark, const char *spawn, const char *param, const char *metric, double value, const char *unit) {
+    if (result_count == MAX_RESULTS) {
+        return;
+    }
+    Result *r = &results[result_count++];
+    snprintf(r->benchmark, sizeof(r->benchmark), "%s", benchmark);
+    snprintf(r->spawn, sizeof(r->spawn), "%s", spawn);
+    snprintf(r->param, sizeof(r->param), "%s", param);
+    snprintf(r->metric, sizeof(r->metric), "%s", metric);
+    r->value = value;
+    r->unit = unit;
+}
+
+// Write lines repeated count times to the script file, wrapped in an optional prologue and epilogue
+int write_script(const char *prologue, const char *line, int count, const char *epilogue) {
+    FILE *file = fopen(script_path, "w");
+    if (!file) {
+        perror(script_path);
+        return -1;
+    }
+    if (prologue) fputs(prologue, file);
+    for (int i = 0; i < count; i++) {
+        fputs(line, file);
+    }
+    if (epilogue) fputs(epilogue, file);
+    fclose(file);
+    return 0;
+}
+
+// Run myshell on the script with a fresh stats log. path_prefix, if set, is put in front of PATH.
+int run_shell(const char *spawn, const char *path_prefix) {
+    unlink(log_path);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        setenv("MYSHELL_SPAWN", spawn, 1);
+        setenv("MYSHELL_STATS_LOG", log_path, 1);
+        char history[300];
+        snprintf(history, sizeof(history), "%s/history", temp_dir);
+        setenv("MYSHELL_HISTFILE", history, 1);
+        if (path_prefix) {
+            const char *path = getenv("PATH");
+            char *full = malloc(strlen(path_prefix) + strlen(path ? path : "") + 2);
+            sprintf(full, "%s:%s", path_prefix, path ? path : "");
+            setenv("PATH", full, 1);
+        }
+        execl(shell_path, shell_path, script_path, (char *)NULL);
+        perror(shell_path);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s exited abnormally running %s\n", shell_path, script_path);
+        return -1;
+    }
+    return 0;
+}
+
+double json_number(const char *line, const char *key) {
+    const char *p = strstr(line, key);
+    return p ? strtod(p + strlen(key), NULL) : 0;
+}
+
+// Read the stats log. Returns the number of samples, *samples is malloc'd.
+int read_samples(Sample **samples) {
+    FILE *file = fopen(log_path, "r");
+    if (!file) {
+        perror(log_path);
+        *samples = NULL;
+        return 0;
+    }
+    int count = 0, capacity = 1024;
+    *samples = malloc(capacity * sizeof(Sample));
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, file) > 0) {
+        if (count == capacity) {
+            capacity *= 2;
+            *samples = realloc(*samples, capacity * sizeof(Sample));
+        }
+        (*samples)[count].real = json_number(line, "\"real\":");
+        (*samples)[count].start = json_number(line, "\"start\":");
+        count++;
+    }
+    free(line);
+    fclose(file);
+    return count;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Percentile of sorted values, nearest rank
+double percentile(double *sorted, int count, double p) {
+    int rank = (int)(p / 100.0 * count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+// Add p50/p90/p99/max rows (microseconds) for the job latencies in the log
+void add_latency_results(const char *benchmark, const char *spawn, const char *param) {
+    Sample *samples;
+    int count = read_samples(&samples);
+    if (count == 0) {
+        free(samples);
+        return;
+    }
+    double *values = malloc(count * sizeof(double));
+    for (int i = 0; i < count; i++) {
+        values[i] = samples[i].real * 1e6;
+    }
+    qsort(values, count, sizeof(double), compare_double);
+    add_result(benchmark, spawn, param, "p50", percentile(values, count, 50), "us");
+    add_result(benchmark, spawn, param, "p90", percentile(values, count, 90), "us");
+    add_result(benchmark, spawn, param, "p99", percentile(values, count, 99), "us");
+    add_result(benchmark, spawn, param, "max", values[count - 1], "us");
+    free(values);
+    free(samples);
+}
+
+void bench_launch(int launches) {
+    const char *kinds[][2] = {
+        { "plain", "true\n" },
+        { "redirect", "true > /dev/null\n" },
+        { "pipe", "true | true\n" },
+    };
+    for (size_t m = 0; m < sizeof(spawn_modes) / sizeof(spawn_modes[0]); m++) {
+        for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+            if (write_script(NULL, kinds[k][1], launches, NULL) == 0 && run_shell(spawn_modes[m], NULL) == 0) {
+                add_latency_results("launch", spawn_modes[m], kinds[k][0]);
+            }
+        }
+    }
+}
+
+void bench_path_lookup(int launches) {
+    int lengths[] = { 0, 16, 64, 256, 1024 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        int n = lengths[i];
+        char *prefix = NULL;
+        if (n > 0) {
+            prefix = malloc(n * 64);
+            prefix[0] = '\0';
+            char *p = prefix;
+            for (int d = 0; d < n; d++) {
+                p += sprintf(p, "%s%s/missing%d", d ? ":" : "", temp_dir, d);
+            }
+        }
+        char param[48];
+        snprintf(param, sizeof(param), "path_dirs=%d", n);
+        if (write_script(NULL, "hash -r\ntrue\n", launches, NULL) == 0 && run_shell("posix_spawn", prefix) == 0) {
+            add_latency_results("pathlookup", "posix_spawn", param);
+        }
+        free(prefix);
+    }
+}
+
+void bench_pipeline(int payload_mb) {
+    char data_path[300];
+    snprintf(data_path, sizeof(data_path), "%s/payload", temp_dir);
+    int fd = open(data_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(data_path);
+        return;
+    }
+    char block[1 << 16];
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = 'a' + i % 26;
+    }
+    for (long written = 0; written < (long)payload_mb << 20; written += sizeof(block)) {
+        if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block)) {
+            perror(data_path);
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    int stages[] = { 2, 4 };
+    for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+        char line[512];
+        int length = snprintf(line, sizeof(line), "cat %s", data_path);
+        for (int i = 1; i < stages[s]; i++) {
+            length += snprintf(line + length, sizeof(line) - length, " | cat");
+        }
+        snprintf(line + length, sizeof(line) - length, " > /dev/null\n");
+
+        char param[48];
+        snprintf(param, sizeof(param), "stages=%d,mb=%d", stages[s], payload_mb);
+        if (write_script(NULL, line, 3, NULL) != 0 || run_shell("posix_spawn", NULL) != 0) {
+            continue;
+        }
+        Sample *samples;
+        int count = read_samples(&samples);
+        double best = 0;
+        for (int i = 0; i < count; i++) {
+            if (samples[i].real > 0 && payload_mb / samples[i].real > best) {
+                best = payload_mb / samples[i].real;
+            }
+        }
+        free(samples);
+        add_result("pipeline", "posix_spawn", param, "best", best, "MB/s");
+    }
+    unlink(data_path);
+}
+
+void bench_fanout(int jobs) {
+    for (size_t m = 0; m < sizeof(spawn_modes) / sizeof(spawn_modes[0]); m++) {
+        if (write_script(NULL, "true &\n", jobs, "wait\n") != 0 || run_shell(spawn_modes[m], NULL) != 0) {
+            continue;
+        }
+        Sample *samples;
+        int count = read_samples(&samples);
+        if (count == 0) {
+            free(samples);
+            continue;
+        }
+        // From the first launch to the last job being reaped
+        double first = samples[0].start, last = 0;
+        for (int i = 0; i < count; i++) {
+            if (samples[i].start < first) first = samples[i].start;
+            if (samples[i].start + samples[i].real > last) last = samples[i].start + samples[i].real;
+        }
+        free(samples);
+        char param[48];
+        snprintf(param, sizeof(param), "jobs=%d", count);
+        add_result("fanout", spawn_modes[m], param, "rate", last > first ? count / (last - first) : 0, "jobs/s");
+    }
+}
+
+void print_results(FILE *out, int json) {
+    if (json) {
+        fprintf(out, "[\n");
+        for (int i = 0; i < result_count; i++) {
+            Result *r = &results[i];
+            fprintf(out, "  {\"benchmark\":\"%s\",\"spawn\":\"%s\",\"param\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}%s\n",
+                    r->benchmark, r->spawn, r->param, r->metric, r->value, r->unit, i + 1 < result_count ? "," : "");
+        }
+        fprintf(out, "]\n");
+    } else {
+        fprintf(out, "benchmark,spawn,param,metric,value,unit\n");
+        for (int i = 0; i < result_count; i++) {
+            Result *r = &results[i];
+            fprintf(out, "%s,%s,\"%s\",%s,%.3f,%s\n", r->benchmark, r->spawn, r->param, r->metric, r->value, r->unit);
+        }
+    }
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-s shell] [-n launches] [-m payload_mb] [-j jobs] [-f csv|json] [-o file]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    int launches = 1000;
+    int payload_mb = 256;
+    int jobs = 500;
+    int json = 0;
+    char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:m:j:f:o:")) != -1) {
+        switch (opt) {
+        case 's': shell_path = optarg; break;
+        case 'n': launches = atoi(optarg); break;
+        case 'm': payload_mb = atoi(optarg); break;
+        case 'j': jobs = atoi(optarg); break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        case 'o': output = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (launches <= 0 || payload_mb <= 0 || jobs <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (access(shell_path, X_OK) != 0) {
+        perror(shell_path);
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(temp_dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(script_path, sizeof(script_path), "%s/script", temp_dir);
+    snprintf(log_path, sizeof(log_path), "%s/stats.log", temp_dir);
+
+    fprintf(stderr, "launch latency...\n");
+    bench_launch(launches);
+    fprintf(stderr, "PATH lookup...\n");
+    bench_path_lookup(launches);
+    fprintf(stderr, "pipeline throughput...\n");
+    bench_pipeline(payload_mb);
+    fprintf(stderr, "background fan-out...\n");
+    bench_fanout(jobs);
+
+    FILE *out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        out = stdout;
+    }
+    print_results(out, json);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/history", temp_dir);
+    unlink(path);
+    unlink(script_path);
+    unlink(log_path);
+    rmdir(temp_dir);
+    return EXIT_SUCCESS;
+}
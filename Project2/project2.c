@@ -1,5 +1,7 @@
 // myshell - Debugged Version with Proper Function Declarations ----
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,60 +10,2306 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <errno.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+#define INPUT_BUFFER_SIZE 65536
+#define ARENA_BLOCK_SIZE 16384
+#define HISTORY_SIZE 10             // entries shown by a plain "history"
+
+// Placement and limits applied to every process of a command before exec,
+// written as leading "@key=value" words: "@cpus=0-3 nice=5 mem=2G cmd ..."
+typedef struct {
+    int has_cpus;
+    int has_nice;
+    int has_mem;
+    cpu_set_t cpus;             // sched_setaffinity
+    int nice;                   // setpriority
+    rlim_t mem;                 // setrlimit(RLIMIT_AS), bytes
+} LaunchOptions;
+
+// A parsed command line: one or more pipeline stages plus the redirections
+typedef struct {
+    char ***stages;             // argv of each stage, allocated in the command arena
+    int stage_count;
+    char *input_file;           // applies to the first stage
+    char *output_file;          // applies to the last stage
+    char *error_file;           // applies to the stage it was written on
+    int error_stage;
+    int append_output;
+    int background;
+    int timed;                  // "time" prefix: report resource usage when done
+    LaunchOptions options;
+    char **tee_files;           // ">|" targets, copies of tee_stage's output
+    int tee_count;
+    int tee_stage;
+} Command;
+
+// Function Prototypes
+
+typedef struct Arena Arena;
+int parse_command(Arena *arena, const char *line, Command *cmd);
+void execute_with_redirection(char **args, char *input_file, char *output_file, char *error_file, int append_output, int background);
+void execute_command(char **args, int background);
+int handle_internal_commands(char **args);
+char *find_executable(char *command);
+int handle_hash_command(char **args);
+void execute_pipe_command(Command *cmd);
+void execute_parsed_command(Command *cmd);
+int handle_pipesize_command(char **args);
+int handle_spawnmode_command(char **args);
+int handle_job_command(char **args);
+int handle_parallel_command(char **args);
+int handle_jobstats_command(char **args);
+
+pid_t running_foreground_pid = -1;
+
+int shell_interactive = 0;      // stdin is a terminal we hand to foreground pipelines
+int pipe_buffer_size = 0;       // F_SETPIPE_SZ for pipeline pipes, 0 keeps the kernel default
+
+sigset_t sigchld_mask;           // SIGCHLD stays blocked in the shell and is read from signal_fd
+int signal_fd = -1;
+
+// Persistent history: a ring of fixed-size slots in a memory-mapped file
+// ($MYSHELL_HISTFILE, default ~/.myshell_history) shared by every running shell.
+// Appending claims a sequence number with one atomic add on the shared header and
+// fills slot seq % capacity, so it is O(1) and safe across processes. A slot is
+// published by storing seq + 1 into it last; readers re-check that value after
+// copying the text. Lines longer than a slot keep only their start and are
+// marked truncated, so history -i will not run a cut-off command.
+#define HISTORY_MAGIC 0x5348594dU       // "MYHS"
+#define HISTORY_CAPACITY 262144         // slots in a newly created file
+#define HISTORY_SLOT_SIZE 256
+#define HISTORY_HEADER_SIZE 4096
+#define HISTORY_TEXT_SIZE (HISTORY_SLOT_SIZE - 12)
+#define HISTORY_TRUNCATED 0x80000000U   // set in a slot's length when the line did not fit
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slot_size;
+    uint64_t capacity;
+    uint64_t next_seq;                  // claimed with an atomic fetch-add by appenders
+} HistoryHeader;
+
+typedef struct {
+    uint64_t seq;                       // seq + 1 once published, 0 while being written
+    uint32_t length;                    // | HISTORY_TRUNCATED if only the start was kept
+    char text[HISTORY_TEXT_SIZE];
+} HistorySlot;
+
+HistoryHeader *history_header = NULL;
+HistorySlot *history_slots = NULL;
+
+// Map the history file, creating or resetting it if needed. Falls back to an
+// anonymous mapping so the shell still has a (non-persistent) history.
+void history_open(void) {
+    char path[4096];
+    char *histfile = getenv("MYSHELL_HISTFILE");
+    char *home = getenv("HOME");
+    int fd = -1;
+
+    if (histfile) {
+        snprintf(path, sizeof(path), "%s", histfile);
+    } else if (home) {
+        snprintf(path, sizeof(path), "%s/.myshell_history", home);
+    } else {
+        path[0] = '\0';
+    }
+    if (path[0]) {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+
+    size_t size = HISTORY_HEADER_SIZE + (size_t)HISTORY_CAPACITY * HISTORY_SLOT_SIZE;
+    void *map = MAP_FAILED;
+
+    if (fd >= 0) {
+        // Only one shell may initialise a new file
+        flock(fd, LOCK_EX);
+        HistoryHeader header;
+        struct stat st;
+        int valid = fstat(fd, &st) == 0 &&
+                    pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                    header.magic == HISTORY_MAGIC &&
+                    header.slot_size == HISTORY_SLOT_SIZE &&
+                    header.capacity > 0 &&
+                    (size_t)st.st_size == HISTORY_HEADER_SIZE + header.capacity * HISTORY_SLOT_SIZE;
+
+        if (valid) {
+            size = st.st_size;
+        } else {
+            memset(&header, 0, sizeof(header));
+            header.magic = HISTORY_MAGIC;
+            header.slot_size = HISTORY_SLOT_SIZE;
+            header.capacity = HISTORY_CAPACITY;
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 ||
+                pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+                perror("Error initialising history file");
+                size = HISTORY_HEADER_SIZE + (size_t)HISTORY_CAPACITY * HISTORY_SLOT_SIZE;
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd >= 0) {
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            flock(fd, LOCK_UN);
+            close(fd);
+        }
+    }
+
+    if (map == MAP_FAILED) {
+        size = HISTORY_HEADER_SIZE + (size_t)HISTORY_CAPACITY * HISTORY_SLOT_SIZE;
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("History unavailable");
+            return;
+        }
+        history_header = map;
+        history_header->magic = HISTORY_MAGIC;
+        history_header->slot_size = HISTORY_SLOT_SIZE;
+        history_header->capacity = HISTORY_CAPACITY;
+    }
+
+    history_header = map;
+    history_slots = (HistorySlot *)((char *)map + HISTORY_HEADER_SIZE);
+}
+
+uint64_t history_next_seq(void) {
+    return history_header ? __atomic_load_n(&history_header->next_seq, __ATOMIC_ACQUIRE) : 0;
+}
+
+// Oldest sequence number still held by the ring
+uint64_t history_first_seq(void) {
+    if (!history_header) {
+        return 0;
+    }
+    uint64_t next = history_next_seq();
+    return next > history_header->capacity ? next - history_header->capacity : 0;
+}
+
+void history_add(const char *line) {
+    if (!history_header) {
+        return;
+    }
+    size_t length = strcspn(line, "\n");
+    if (length == 0) {
+        return;
+    }
+    uint32_t truncated = 0;
+    if (length >= HISTORY_TEXT_SIZE) {
+        length = HISTORY_TEXT_SIZE - 1;
+        truncated = HISTORY_TRUNCATED;
+    }
+
+    uint64_t seq = __atomic_fetch_add(&history_header->next_seq, 1, __ATOMIC_ACQ_REL);
+    HistorySlot *slot = &history_slots[seq % history_header->capacity];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot->text, line, length);
+    slot->text[length] = '\0';
+    slot->length = length | truncated;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copy entry seq into buffer (HISTORY_TEXT_SIZE bytes). Returns 1 if only the
+// start of the line was kept, or -1 if the slot was overwritten or is still
+// being written by another shell.
+int history_get(uint64_t seq, char *buffer) {
+    if (!history_header) {
+        return -1;
+    }
+    HistorySlot *slot = &history_slots[seq % history_header->capacity];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+        return -1;
+    }
+    uint32_t length = slot->length;
+    int truncated = (length & HISTORY_TRUNCATED) != 0;
+    length &= ~HISTORY_TRUNCATED;
+    if (length >= HISTORY_TEXT_SIZE) {
+        return -1;
+    }
+    memcpy(buffer, slot->text, length);
+    buffer[length] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + 1 ? truncated : -1;
+}
+
+// Trigram index over the history text, built lazily on the first search and
+// caught up (including other shells' appends) before each later one. A query
+// only verifies the entries listed under its rarest trigram.
+typedef struct {
+    uint32_t key;                       // trigram + 1, 0 marks an empty slot
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *seqs;                     // low 32 bits of the sequence numbers, ascending
+} TrigramPosting;
+
+TrigramPosting *trigram_table = NULL;
+uint32_t trigram_capacity = 0;          // power of two
+uint32_t trigram_count = 0;
+uint64_t trigram_indexed_seq = 0;       // entries below this are in the index
+
+uint32_t trigram_key(const char *p) {
+    return ((uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2]) + 1;
+}
+
+TrigramPosting *trigram_lookup(uint32_t key, int create) {
+    if (create && (trigram_count + 1) * 2 > trigram_capacity) {
+        TrigramPosting *old = trigram_table;
+        uint32_t old_capacity = trigram_capacity;
+        trigram_capacity = old_capacity ? old_capacity * 2 : 4096;
+        trigram_table = calloc(trigram_capacity, sizeof(TrigramPosting));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].key) {
+                uint32_t j = (old[i].key * 2654435761u) & (trigram_capacity - 1);
+                while (trigram_table[j].key) {
+                    j = (j + 1) & (trigram_capacity - 1);
+                }
+                trigram_table[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    if (!trigram_table) {
+        return NULL;
+    }
+
+    uint32_t i = (key * 2654435761u) & (trigram_capacity - 1);
+    while (trigram_table[i].key && trigram_table[i].key != key) {
+        i = (i + 1) & (trigram_capacity - 1);
+    }
+    if (!trigram_table[i].key) {
+        if (!create) {
+            return NULL;
+        }
+        trigram_table[i].key = key;
+        trigram_count++;
+    }
+    return &trigram_table[i];
+}
+
+void history_index_update(void) {
+    char text[HISTORY_TEXT_SIZE];
+    uint64_t next = history_next_seq();
+    uint64_t seq = trigram_indexed_seq > history_first_seq() ? trigram_indexed_seq : history_first_seq();
+
+    for (; seq < next; seq++) {
+        if (history_get(seq, text) < 0) {
+            continue;
+        }
+        for (size_t i = 0; text[i] && text[i + 1] && text[i + 2]; i++) {
+            TrigramPosting *posting = trigram_lookup(trigram_key(&text[i]), 1);
+            if (posting->count > 0 && posting->seqs[posting->count - 1] == (uint32_t)seq) {
+                continue;   // trigram repeats within this entry
+            }
+            if (posting->count == posting->capacity) {
+                posting->capacity = posting->capacity ? posting->capacity * 2 : 4;
+                posting->seqs = realloc(posting->seqs, posting->capacity * sizeof(uint32_t));
+            }
+            posting->seqs[posting->count++] = (uint32_t)seq;
+        }
+    }
+    trigram_indexed_seq = next;
+}
+
+// Print entries matching query, newest first, using the index when the query
+// has at least one trigram. Indexes printed are usable with history -i.
+void history_search(const char *query, int prefix) {
+    char text[HISTORY_TEXT_SIZE];
+    uint64_t next = history_next_seq();
+    uint64_t first = history_first_seq();
+    size_t query_length = strlen(query);
+
+    if (query_length < 3) {
+        for (uint64_t seq = next; seq > first; seq--) {
+            if (history_get(seq - 1, text) >= 0 &&
+                (prefix ? strncmp(text, query, query_length) == 0 : strstr(text, query) != NULL)) {
+                printf("%llu %s\n", (unsigned long long)(next - seq), text);
+            }
+        }
+        return;
+    }
+
+    history_index_update();
+    TrigramPosting *rarest = NULL;
+    for (size_t i = 0; i + 2 < query_length; i++) {
+        TrigramPosting *posting = trigram_lookup(trigram_key(&query[i]), 0);
+        if (!posting) {
+            return;     // a trigram no entry contains
+        }
+        if (!rarest || posting->count < rarest->count) {
+            rarest = posting;
+        }
+    }
+
+    for (uint32_t i = rarest->count; i > 0; i--) {
+        // Rebuild the full sequence number from its low 32 bits
+        uint64_t seq = (next & ~(uint64_t)0xffffffff) | rarest->seqs[i - 1];
+        if (seq >= next) {
+            seq -= (uint64_t)1 << 32;
+        }
+        if (seq < first || seq >= next) {
+            continue;
+        }
+        if (history_get(seq, text) >= 0 &&
+            (prefix ? strncmp(text, query, query_length) == 0 : strstr(text, query) != NULL)) {
+            printf("%llu %s\n", (unsigned long long)(next - 1 - seq), text);
+        }
+    }
+}
+
+// Buffered command input. Input is read in large blocks and split into lines
+// here, so a script costs one read() per INPUT_BUFFER_SIZE bytes instead of one
+// per line, and a line may be any length (the buffer grows to hold it).
+typedef struct {
+    int fd;             // -1 when reading a -c string
+    char *buffer;
+    size_t capacity;
+    size_t start;       // first byte not yet returned
+    size_t end;         // end of the buffered data
+    int eof;
+} InputReader;
+
+InputReader shell_input;
+
+void reader_init(InputReader *reader, int fd) {
+    reader->fd = fd;
+    reader->capacity = INPUT_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+}
+
+void reader_init_string(InputReader *reader, const char *text) {
+    reader->fd = -1;
+    reader->end = strlen(text);
+    reader->capacity = reader->end + 1;
+    reader->buffer = malloc(reader->capacity);
+    memcpy(reader->buffer, text, reader->end);
+    reader->start = 0;
+    reader->eof = 1;
+}
+
+// True if reader_getline can return without reading
+int reader_has_line(InputReader *reader) {
+    return reader->eof || memchr(reader->buffer + reader->start, '\n', reader->end - reader->start) != NULL;
+}
+
+// Next line without its newline, or NULL at end of input. The line lives in the
+// reader's buffer and may be modified; it stays valid until the next call.
+char *reader_getline(InputReader *reader) {
+    while (1) {
+        char *line = reader->buffer + reader->start;
+        char *newline = memchr(line, '\n', reader->end - reader->start);
+        if (newline) {
+            *newline = '\0';
+            reader->start = newline - reader->buffer + 1;
+            return line;
+        }
+
+        if (reader->start > 0) {
+            memmove(reader->buffer, line, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end + 1 >= reader->capacity) {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+        }
+
+        if (reader->eof) {
+            if (reader->end == 0) {
+                return NULL;
+            }
+            reader->buffer[reader->end] = '\0';
+            reader->start = reader->end;
+            return reader->buffer;
+        }
+
+        ssize_t n = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            reader->eof = 1;
+        } else {
+            reader->end += n;
+        }
+    }
+}
+
+void reader_free(InputReader *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+// Per-command arena. The parsed line, its tokens and the argv vectors of every
+// stage are carved out of it and the whole lot is dropped at once by resetting
+// it before the next command. Blocks are kept across resets (merged into one
+// big enough for the largest command so far), so the REPL stops calling
+// malloc once it has seen its biggest line.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+struct Arena {
+    ArenaBlock *first;
+    ArenaBlock *current;
+};
+
+Arena command_arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+
+    ArenaBlock *block = arena->current;
+    while (block && block->used + size > block->size) {
+        block = block->next;
+        if (block) {
+            block->used = 0;
+        }
+    }
+
+    if (!block) {
+        size_t block_size = ARENA_BLOCK_SIZE;
+        if (arena->current && arena->current->size * 2 > block_size) {
+            block_size = arena->current->size * 2;
+        }
+        if (size > block_size) {
+            block_size = size;
+        }
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        if (arena->current) {
+            arena->current->next = block;
+        } else {
+            arena->first = block;
+        }
+    }
+
+    arena->current = block;
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+char *arena_strndup(Arena *arena, const char *text, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Forget everything allocated since the last reset. A chain of blocks is
+// replaced by a single block as large as all of them together.
+void arena_reset(Arena *arena) {
+    ArenaBlock *first = arena->first;
+    if (!first) {
+        return;
+    }
+    if (first->next) {
+        size_t total = 0;
+        for (ArenaBlock *block = first; block; ) {
+            ArenaBlock *next = block->next;
+            total += block->size;
+            free(block);
+            block = next;
+        }
+        first = malloc(sizeof(ArenaBlock) + total);
+        first->next = NULL;
+        first->size = total;
+        arena->first = first;
+    }
+    first->used = 0;
+    arena->current = first;
+}
+
+void arena_free(Arena *arena) {
+    for (ArenaBlock *block = arena->first; block; ) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+// Executable lookup cache (command name -> resolved path), like bash's hash table.
+// Entries are added on the first successful PATH search and the whole table is
+// dropped whenever PATH changes, so repeated commands cost no access() calls.
+#define HASH_BUCKETS 64
+
+typedef struct HashEntry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct HashEntry *next;
+} HashEntry;
+
+HashEntry *exec_hash[HASH_BUCKETS];
+char *exec_hash_path = NULL;        // PATH value the cached entries were resolved against
+unsigned long exec_hash_hits = 0;
+unsigned long exec_hash_misses = 0;
+
+unsigned int hash_string(const char *s) {
+    unsigned int h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h % HASH_BUCKETS;
+}
+
+// Drop every cached entry (hash -r, or PATH changed)
+void exec_hash_reset(void) {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        HashEntry *entry = exec_hash[i];
+        while (entry) {
+            HashEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        exec_hash[i] = NULL;
+    }
+}
+
+// Invalidate the cache if PATH is not the one the entries were resolved against
+void exec_hash_check_path(const char *path) {
+    if (exec_hash_path && strcmp(exec_hash_path, path) == 0) {
+        return;
+    }
+    exec_hash_reset();
+    free(exec_hash_path);
+    exec_hash_path = strdup(path);
+}
+
+// Function to find executable in PATH.
+// The returned string is owned by the cache and stays valid until the next reset.
+char *find_executable(char *command) {
+    char *path = getenv("PATH");
+    if (!path) {
+        return NULL;
+    }
+
+    exec_hash_check_path(path);
+
+    unsigned int bucket = hash_string(command);
+    for (HashEntry *entry = exec_hash[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->name, command) == 0) {
+            entry->hits++;
+            exec_hash_hits++;
+            return entry->path;
+        }
+    }
+    exec_hash_misses++;
+
+    char *path_copy = strdup(path);
+    char *dir;
+    char full_path[4096];
+    dir = strtok(path_copy, ":");
+
+    while (dir) {
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir, command);
+        if (access(full_path, X_OK) == 0) {
+            free(path_copy);
+            HashEntry *entry = malloc(sizeof(HashEntry));
+            entry->name = strdup(command);
+            entry->path = strdup(full_path);
+            entry->hits = 1;
+            entry->next = exec_hash[bucket];
+            exec_hash[bucket] = entry;
+            return entry->path;
+        }
+        dir = strtok(NULL, ":");
+    }
+
+    free(path_copy);
+    return NULL;
+}
+
+// hash builtin: "hash" lists the cache, "hash -r" clears it, "hash name..." resolves names
+int handle_hash_command(char **args) {
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        exec_hash_reset();
+        return 1;
+    }
+
+    if (args[1]) {
+        for (int i = 1; args[i]; i++) {
+            if (!find_executable(args[i])) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+            }
+        }
+        return 1;
+    }
+
+    int empty = 1;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        for (HashEntry *entry = exec_hash[i]; entry; entry = entry->next) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = 0;
+            }
+            printf("%4lu\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (empty) {
+        printf("hash: hash table empty\n");
+    }
+    printf("hash: %lu hits, %lu misses\n", exec_hash_hits, exec_hash_misses);
+    return 1;
+}
+
+// Process launch backends. posix_spawn and vfork avoid copying the shell's page
+// tables on every command, so launch cost stays flat as the shell grows; plain
+// fork is kept as a fallback, and zygote hands launches to a small helper
+// process. Selected with MYSHELL_SPAWN or the spawnmode builtin.
+typedef enum {
+    SPAWN_FORK,
+    SPAWN_VFORK,
+    SPAWN_POSIX_SPAWN,
+    SPAWN_ZYGOTE
+} SpawnMode;
+
+const char *spawn_mode_names[] = { "fork", "vfork", "posix_spawn", "zygote" };
+SpawnMode spawn_mode = SPAWN_POSIX_SPAWN;
+
+// File descriptors a child gets before exec. Redirection files are opened by the
+// parent so every backend only has to dup2/close in the child.
+typedef struct {
+    int in_fd;          // becomes stdin if >= 0
+    int out_fd;         // becomes stdout if >= 0
+    int err_fd;         // becomes stderr if >= 0
+    pid_t pgid;         // process group to join: -1 stays in the shell's, 0 starts a new one
+    int foreground;     // take the terminal when joining a new process group
+    LaunchOptions *options;     // NULL when the command has no @ prefix
+} LaunchSpec;
+
+// Options of the command being launched, picked up by every LaunchSpec so
+// pipelines, background jobs and parallel runs all get them
+LaunchOptions *launch_options = NULL;
+
+void launch_spec_init(LaunchSpec *spec) {
+    spec->in_fd = -1;
+    spec->out_fd = -1;
+    spec->err_fd = -1;
+    spec->pgid = -1;
+    spec->foreground = 0;
+    spec->options = launch_options;
+}
+
+int launch_options_set(LaunchOptions *options) {
+    return options && (options->has_cpus || options->has_nice || options->has_mem);
+}
+
+// Parse a cpu list such as "0-3,8,10-11"
+int parse_cpu_list(const char *text, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*text) {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        text = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+// Parse a byte count with an optional K, M or G suffix
+int parse_size(const char *text, rlim_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+// Returns 1 if text is a known key=value launch option
+int is_launch_option(const char *text) {
+    return strncmp(text, "cpus=", 5) == 0 || strncmp(text, "nice=", 5) == 0 || strncmp(text, "mem=", 4) == 0;
+}
+
+// Parse one cpus=, nice= or mem= word into options. Returns -1 (and reports) on error.
+int parse_launch_option(const char *text, LaunchOptions *options) {
+    int ok = 0;
+    if (strncmp(text, "cpus=", 5) == 0) {
+        ok = parse_cpu_list(text + 5, &options->cpus) == 0;
+        options->has_cpus = ok;
+    } else if (strncmp(text, "nice=", 5) == 0) {
+        char *end;
+        long nice = strtol(text + 5, &end, 10);
+        ok = end != text + 5 && *end == '\0' && nice >= -20 && nice <= 19;
+        options->nice = nice;
+        options->has_nice = ok;
+    } else if (strncmp(text, "mem=", 4) == 0) {
+        ok = parse_size(text + 4, &options->mem) == 0;
+        options->has_mem = ok;
+    } else {
+        fprintf(stderr, "Unknown launch option: @%s (expected cpus=, nice= or mem=)\n", text);
+        return -1;
+    }
+    if (!ok) {
+        fprintf(stderr, "Invalid launch option: %s\n", text);
+        return -1;
+    }
+    return 0;
+}
+
+// Apply launch options in the child. Raw syscalls only, so this is safe after vfork.
+int apply_launch_options(LaunchOptions *options) {
+    if (options->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &options->cpus) != 0) {
+        return -1;
+    }
+    if (options->has_nice && setpriority(PRIO_PROCESS, 0, options->nice) != 0) {
+        return -1;
+    }
+    if (options->has_mem) {
+        struct rlimit limit = { options->mem, options->mem };
+        if (setrlimit(RLIMIT_AS, &limit) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Close the parent's copies of the redirection files
+void launch_spec_close_files(LaunchSpec *spec) {
+    if (spec->in_fd >= 0) close(spec->in_fd);
+    if (spec->out_fd >= 0) close(spec->out_fd);
+    if (spec->err_fd >= 0) close(spec->err_fd);
+    spec->in_fd = -1;
+    spec->out_fd = -1;
+    spec->err_fd = -1;
+}
+
+// Open <, >, >> and 2> targets in the parent. Returns -1 (and reports) on failure.
+int open_redirections(LaunchSpec *spec, char *input_file, char *output_file, char *error_file, int append_output) {
+    if (input_file) {
+        spec->in_fd = open(input_file, O_RDONLY | O_CLOEXEC);
+        if (spec->in_fd < 0) {
+            perror("Error opening input file");
+            launch_spec_close_files(spec);
+            return -1;
+        }
+    }
+
+    if (output_file) {
+        spec->out_fd = open(output_file, O_WRONLY | O_CREAT | O_CLOEXEC | (append_output ? O_APPEND : O_TRUNC), 0644);
+        if (spec->out_fd < 0) {
+            perror("Error opening output file");
+            launch_spec_close_files(spec);
+            return -1;
+        }
+    }
+
+    if (error_file) {
+        spec->err_fd = open(error_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (spec->err_fd < 0) {
+            perror("Error opening error file");
+            launch_spec_close_files(spec);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Report why the child could not run and exit. strerror() may use the locale
+// and allocate, so the common errors have their text here and the rest are
+// shown as their number.
+void child_fail(const char *what, int status) {
+    static const struct { int error; const char *text; } messages[] = {
+        { ENOENT, "No such file or directory" }, { EACCES, "Permission denied" },
+        { ENOEXEC, "Exec format error" }, { ENOTDIR, "Not a directory" },
+        { E2BIG, "Argument list too long" }, { ENOMEM, "Cannot allocate memory" },
+        { ETXTBSY, "Text file busy" }, { ELOOP, "Too many levels of symbolic links" },
+        { EPERM, "Operation not permitted" }, { EINVAL, "Invalid argument" },
+    };
+    int error = errno;
+    const char *text = NULL;
+    for (size_t i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+        if (messages[i].error == error) {
+            text = messages[i].text;
+        }
+    }
+    char number[24] = "errno ";
+    if (!text) {
+        char digits[12];
+        int n = 0;
+        do {
+            digits[n++] = '0' + error % 10;
+            error /= 10;
+        } while (error > 0 && n < (int)sizeof(digits));
+        for (int i = 0; i < n; i++) {
+            number[6 + i] = digits[n - 1 - i];
+        }
+        number[6 + n] = '\0';
+        text = number;
+    }
+    write(STDERR_FILENO, what, strlen(what));
+    write(STDERR_FILENO, ": ", 2);
+    write(STDERR_FILENO, text, strlen(text));
+    write(STDERR_FILENO, "\n", 1);
+    _exit(status);
+}
+
+// Restore the default action for sig. sigaction rather than signal(), which is
+// not on the async-signal-safe list.
+void child_default_signal(int sig) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, NULL);
+}
+
+// Child side of the fork/vfork backends. Only async-signal-safe calls are used
+// here because a vfork child still runs on the parent's memory. Pipe ends are
+// O_CLOEXEC, so the ones this stage does not use disappear at exec.
+void child_exec(char *executable, char **args, LaunchSpec *spec) {
+    if (spec->pgid >= 0) {
+        setpgid(0, spec->pgid);
+        if (spec->foreground && shell_interactive) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+    }
+    child_default_signal(SIGTSTP);
+    child_default_signal(SIGTTOU);
+    child_default_signal(SIGTTIN);
+    sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+
+    if (spec->in_fd >= 0) dup2(spec->in_fd, STDIN_FILENO);
+    if (spec->out_fd >= 0) dup2(spec->out_fd, STDOUT_FILENO);
+    if (spec->err_fd >= 0) dup2(spec->err_fd, STDERR_FILENO);
+    if (spec->in_fd > STDERR_FILENO) close(spec->in_fd);
+    if (spec->out_fd > STDERR_FILENO) close(spec->out_fd);
+    if (spec->err_fd > STDERR_FILENO) close(spec->err_fd);
+
+    if (spec->options && apply_launch_options(spec->options) != 0) {
+        child_fail("Launch options failed", 126);
+    }
+
+    execv(executable, args);
+    child_fail("Exec failed", 127);
+}
+
+pid_t launch_posix_spawn(char *executable, char **args, LaunchSpec *spec) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    if (spec->in_fd >= 0) posix_spawn_file_actions_adddup2(&actions, spec->in_fd, STDIN_FILENO);
+    if (spec->out_fd >= 0) posix_spawn_file_actions_adddup2(&actions, spec->out_fd, STDOUT_FILENO);
+    if (spec->err_fd >= 0) posix_spawn_file_actions_adddup2(&actions, spec->err_fd, STDERR_FILENO);
+    if (spec->in_fd > STDERR_FILENO) posix_spawn_file_actions_addclose(&actions, spec->in_fd);
+    if (spec->out_fd > STDERR_FILENO) posix_spawn_file_actions_addclose(&actions, spec->out_fd);
+    if (spec->err_fd > STDERR_FILENO) posix_spawn_file_actions_addclose(&actions, spec->err_fd);
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGTTIN);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    sigset_t mask;
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (spec->pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, spec->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    int err = posix_spawn(&pid, executable, &actions, &attr, args, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Zygote backend. A helper forked while the shell is still small receives
+// launch requests over a socketpair: a fixed header, then the path, argv and
+// environment as NUL-separated strings, with the stdin/stdout/stderr
+// descriptors attached as SCM_RIGHTS. It starts each command with
+// clone(CLONE_PARENT), so the shell is the parent and reaps it like any other
+// child, and replies with the pid (or -errno).
+typedef struct {
+    uint32_t length;        // bytes of strings after the header
+    int32_t argc;
+    int32_t envc;
+    int32_t fd_mask;        // attached descriptors, in order: 1 stdin, 2 stdout, 4 stderr
+    pid_t pgid;
+    int32_t foreground;
+    int32_t has_options;
+    LaunchOptions options;
+} ZygoteRequest;
+
+pid_t zygote_pid = -1;
+int zygote_fd = -1;
+
+int read_full(int fd, void *buffer, size_t length) {
+    char *p = buffer;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *buffer, size_t length) {
+    const char *p = buffer;
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Helper side: serve requests until the shell closes its end
+void zygote_main(int fd) {
+    // Terminal signals meant for the shell's group must not take the helper down.
+    // SIGTTOU and SIGTTIN are ignored, as in the interactive shell, so children
+    // can take the terminal before they restore the defaults.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+
+    char *strings = NULL;
+    size_t strings_capacity = 0;
+    char **vectors = NULL;
+    size_t vectors_capacity = 0;
+
+    while (1) {
+        ZygoteRequest request;
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov = { &request, sizeof(request) };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || read_full(fd, (char *)&request + n, sizeof(request) - n) != 0) {
+            break;
+        }
+
+        int fds[3] = { -1, -1, -1 };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int *received = (int *)CMSG_DATA(cmsg);
+            for (int i = 0, next = 0; i < 3; i++) {
+                if (request.fd_mask & (1 << i)) {
+                    fds[i] = received[next++];
+                }
+            }
+        }
+
+        if (request.length + 1 > strings_capacity) {
+            strings_capacity = request.length + 1;
+            strings = realloc(strings, strings_capacity);
+        }
+        size_t vector_count = request.argc + request.envc + 2;
+        if (vector_count > vectors_capacity) {
+            vectors_capacity = vector_count;
+            vectors = realloc(vectors, vectors_capacity * sizeof(char *));
+        }
+        if (read_full(fd, strings, request.length) != 0) {
+            break;
+        }
+
+        // path, then argc argv strings, then envc environment strings
+        char *p = strings;
+        char *path = p;
+        p += strlen(p) + 1;
+        char **args = vectors;
+        for (int i = 0; i < request.argc; i++, p += strlen(p) + 1) args[i] = p;
+        args[request.argc] = NULL;
+        char **env = vectors + request.argc + 1;
+        for (int i = 0; i < request.envc; i++, p += strlen(p) + 1) env[i] = p;
+        env[request.envc] = NULL;
+
+        LaunchSpec spec;
+        launch_spec_init(&spec);
+        spec.in_fd = fds[0];
+        spec.out_fd = fds[1];
+        spec.err_fd = fds[2];
+        spec.pgid = request.pgid;
+        spec.foreground = request.foreground;
+        shell_interactive = request.foreground; // Only set when the shell owns a terminal
+        spec.options = request.has_options ? &request.options : NULL;
+
+        int32_t reply = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+        if (reply == 0) {
+            // A raw clone skips libc's fork handling, so only what child_exec
+            // allows is used from here on
+            child_default_signal(SIGINT);
+            child_default_signal(SIGQUIT);
+            environ = env;
+            child_exec(path, args, &spec);
+        }
+        if (reply < 0) {
+            reply = -errno;
+        }
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+        if (write_full(fd, &reply, sizeof(reply)) != 0) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+// Fork the helper. Called first thing in main, before the history is mapped or
+// anything is allocated, so it inherits as little as possible; spawnmode zygote
+// only switches to it.
+int zygote_start(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        perror("zygote socketpair failed");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("zygote fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        if (signal_fd >= 0) close(signal_fd);
+        zygote_main(fds[1]);
+    }
+    close(fds[1]);
+    zygote_fd = fds[0];
+    zygote_pid = pid;
+    return 0;
+}
+
+void zygote_stop(void) {
+    if (zygote_fd >= 0) {
+        close(zygote_fd);       // the helper exits on end of file
+        zygote_fd = -1;
+        zygote_pid = -1;
+    }
+}
+
+// Shell side: send one launch request and wait for the pid
+pid_t launch_zygote(char *executable, char **args, LaunchSpec *spec) {
+    ZygoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.pgid = spec->pgid;
+    request.foreground = spec->foreground && shell_interactive; // The helper was forked before the check
+    if (launch_options_set(spec->options)) {
+        request.has_options = 1;
+        request.options = *spec->options;
+    }
+
+    size_t length = strlen(executable) + 1;
+    for (request.argc = 0; args[request.argc]; request.argc++) {
+        length += strlen(args[request.argc]) + 1;
+    }
+    for (request.envc = 0; environ[request.envc]; request.envc++) {
+        length += strlen(environ[request.envc]) + 1;
+    }
+    request.length = length;
+
+    char *strings = malloc(length);
+    char *p = stpcpy(strings, executable) + 1;
+    for (int i = 0; i < request.argc; i++) p = stpcpy(p, args[i]) + 1;
+    for (int i = 0; i < request.envc; i++) p = stpcpy(p, environ[i]) + 1;
+
+    int fds[3];
+    int fd_count = 0;
+    int spec_fds[3] = { spec->in_fd, spec->out_fd, spec->err_fd };
+    for (int i = 0; i < 3; i++) {
+        if (spec_fds[i] >= 0) {
+            request.fd_mask |= 1 << i;
+            fds[fd_count++] = spec_fds[i];
+        }
+    }
+
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { &request, sizeof(request) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+
+    int32_t reply;
+    ssize_t sent;
+    while ((sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    int failed = sent < 0 ||
+                 write_full(zygote_fd, (char *)&request + sent, sizeof(request) - sent) != 0 ||
+                 write_full(zygote_fd, strings, length) != 0 ||
+                 read_full(zygote_fd, &reply, sizeof(reply)) != 0;
+    free(strings);
+
+    if (failed) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (reply < 0) {
+        errno = -reply;
+        return -1;
+    }
+    return reply;
+}
+
+// Start executable with the given descriptors using the selected backend.
+// posix_spawn has no attributes for affinity or limits, so commands with launch
+// options go through vfork instead. Returns the child's pid, or -1 with errno set.
+pid_t launch_process(char *executable, char **args, LaunchSpec *spec) {
+    pid_t pid;
+
+    switch (spawn_mode) {
+    case SPAWN_POSIX_SPAWN:
+        if (!launch_options_set(spec->options)) {
+            return launch_posix_spawn(executable, args, spec);
+        }
+        pid = vfork();
+        break;
+    case SPAWN_ZYGOTE:
+        pid = launch_zygote(executable, args, spec);
+        if (pid >= 0 || errno != EPIPE) {
+            return pid;
+        }
+        fprintf(stderr, "zygote helper is gone, switching to vfork\n");
+        zygote_stop();
+        spawn_mode = SPAWN_VFORK;
+        pid = vfork();
+        break;
+    case SPAWN_VFORK:
+        pid = vfork();
+        break;
+    default:
+        pid = fork();
+        break;
+    }
+
+    if (pid == 0) {
+        child_exec(executable, args, spec);
+    }
+    return pid;
+}
+
+// Parent side of process group setup. Repeating setpgid here closes the race
+// with the child; it fails harmlessly once the child has exec'd.
+void join_process_group(pid_t pid, LaunchSpec *spec) {
+    if (spec->pgid < 0) {
+        return;
+    }
+    pid_t pgid = spec->pgid ? spec->pgid : pid;
+    setpgid(pid, pgid);
+    if (spec->foreground && shell_interactive) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+}
+
+// Take the terminal back after a foreground pipeline finished or stopped
+void reclaim_terminal(void) {
+    if (shell_interactive) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+}
+
+int set_spawn_mode(const char *name) {
+    for (int i = 0; i < (int)(sizeof(spawn_mode_names) / sizeof(spawn_mode_names[0])); i++) {
+        if (strcmp(name, spawn_mode_names[i]) == 0) {
+            if (i == SPAWN_ZYGOTE && zygote_fd < 0) {
+                fprintf(stderr, "zygote helper is not running, keeping %s\n", spawn_mode_names[spawn_mode]);
+                return 0;
+            }
+            spawn_mode = (SpawnMode)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// spawnmode builtin: show or select the launch backend
+int handle_spawnmode_command(char **args) {
+    if (!args[1]) {
+        printf("spawnmode: %s\n", spawn_mode_names[spawn_mode]);
+    } else if (set_spawn_mode(args[1]) != 0) {
+        fprintf(stderr, "Usage: spawnmode [fork|vfork|posix_spawn|zygote]\n");
+    }
+    return 1;
+}
+
+// ">|" fan-out. The stage writes into a pipe owned by a copier thread in the
+// shell, which tee()s each chunk into a scratch pipe and splice()s it into
+// every target file, then splice()s the chunk itself on downstream (the next
+// stage's pipe, the > file or stdout). Data stays in kernel pipe buffers, and
+// no extra process is forked. Targets that refuse splice (EINVAL, e.g. a
+// terminal) get the same bytes through read/write instead.
+typedef struct FanOut {
+    pthread_t thread;
+    int in_fd;          // read end of the pipe the stage writes into
+    int out_fd;         // downstream
+    int scratch[2];     // tee target, drained into each file in turn
+    int *files;
+    int file_count;
+} FanOut;
+
+// Copy length bytes from fd to out with read/write (out < 0 discards them)
+int fanout_copy(int fd, int out, size_t length) {
+    char buffer[65536];
+    while (length > 0) {
+        ssize_t n = read(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+        if (n <= 0) {
+            return -1;
+        }
+        length -= n;
+        for (ssize_t done = 0; out >= 0 && done < n; ) {
+            ssize_t w = write(out, buffer + done, n - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                out = -1;
+                break;
+            }
+            done += w;
+        }
+    }
+    return out;
+}
+
+// Move exactly length bytes from pipe fd to out. Returns out, or -1 if out failed
+// (the bytes are still consumed, so the pipes stay in step).
+int fanout_move(int fd, int out, size_t length) {
+    while (length > 0) {
+        ssize_t n = out >= 0 ? splice(fd, NULL, out, NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE) : -1;
+        if (n > 0) {
+            length -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (out >= 0 && n < 0 && errno != EINVAL) {
+            out = -1;
+        }
+        return fanout_copy(fd, out, length);
+    }
+    return out;
+}
+
+void *fanout_thread(void *arg) {
+    FanOut *fan = arg;
+
+    // A vanished reader must show up as EPIPE here, not kill the shell
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, NULL);
+
+    while (1) {
+        // Bytes now in the input pipe; tee() blocks until there are some. There is
+        // always a file: fanout_create fails rather than drop one it cannot open.
+        ssize_t chunk = tee(fan->in_fd, fan->scratch[1], INT32_MAX, 0);
+        if (chunk < 0 && errno == EINTR) {
+            continue;
+        }
+        if (chunk <= 0) {
+            break;
+        }
+
+        for (int i = 0; i < fan->file_count; i++) {
+            // The scratch pipe is as large as the input pipe, so every tee takes the whole chunk
+            if (i > 0) {
+                ssize_t n;
+                while ((n = tee(fan->in_fd, fan->scratch[1], chunk, 0)) < 0 && errno == EINTR) {
+                }
+                if (n != chunk) {
+                    // Cannot happen with equal pipe sizes; drain what was copied and move on
+                    fanout_move(fan->scratch[0], -1, n > 0 ? n : 0);
+                    continue;
+                }
+            }
+            if (fanout_move(fan->scratch[0], fan->files[i], chunk) < 0 && fan->files[i] >= 0) {
+                perror(">| write failed");
+                close(fan->files[i]);
+                fan->files[i] = -1;
+            }
+        }
+
+        // Like tee(1), stop once downstream is gone so the writer gets SIGPIPE
+        if (fanout_move(fan->in_fd, fan->out_fd, chunk) < 0) {
+            break;
+        }
+    }
+
+    close(fan->in_fd);
+    fan->in_fd = -1;
+
+    // Downstream sees end of file now
+    if (fan->out_fd >= 0) {
+        close(fan->out_fd);
+        fan->out_fd = -1;
+    }
+    return NULL;
+}
+
+void fanout_free(FanOut *fan) {
+    if (fan->in_fd >= 0) close(fan->in_fd);
+    if (fan->out_fd >= 0) close(fan->out_fd);
+    if (fan->scratch[0] >= 0) close(fan->scratch[0]);
+    if (fan->scratch[1] >= 0) close(fan->scratch[1]);
+    for (int i = 0; i < fan->file_count; i++) {
+        if (fan->files[i] >= 0) close(fan->files[i]);
+    }
+    free(fan->files);
+    free(fan);
+}
+
+// Open the targets and the pipe the stage will write into. *stage_out is set to
+// the pipe's write end; out_fd (downstream) is duplicated, the caller keeps its copy.
+FanOut *fanout_create(char **files, int file_count, int out_fd, int *stage_out) {
+    FanOut *fan = calloc(1, sizeof(FanOut));
+    int input[2];
+    fan->in_fd = fan->out_fd = fan->scratch[0] = fan->scratch[1] = -1;
+    fan->files = malloc(file_count * sizeof(int));
+    fan->file_count = 0;
+
+    for (int i = 0; i < file_count; i++) {
+        fan->files[i] = open(files[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fan->files[i] < 0) {
+            perror(files[i]);
+            fanout_free(fan);
+            return NULL;
+        }
+        fan->file_count++;
+    }
+
+    if (pipe2(input, O_CLOEXEC) == -1 || pipe2(fan->scratch, O_CLOEXEC) == -1) {
+        perror("Pipe failed");
+        fanout_free(fan);
+        return NULL;
+    }
+    fan->in_fd = input[0];
+    *stage_out = input[1];
+    if (pipe_buffer_size > 0) {
+        fcntl(input[1], F_SETPIPE_SZ, pipe_buffer_size);
+    }
+    int size = fcntl(input[1], F_GETPIPE_SZ);
+    if (size > 0 && fcntl(fan->scratch[1], F_SETPIPE_SZ, size) == -1) {
+        perror("Pipe resize failed");
+    }
+
+    fan->out_fd = fcntl(out_fd >= 0 ? out_fd : STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    return fan;
+}
+
+int fanout_start(FanOut *fan) {
+    int err = pthread_create(&fan->thread, NULL, fanout_thread, fan);
+    if (err != 0) {
+        fprintf(stderr, "Fan-out thread failed: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the copier to drain and release everything
+void fanout_finish(FanOut *fan) {
+    pthread_join(fan->thread, NULL);
+    fanout_free(fan);
+}
+
+// Job table. Every launched command or pipeline is a job; ids index a growing
+// array and pids are found through an open-addressing map, so both lookups are
+// O(1) and there is no cap on how many jobs run at once. A new job gets the
+// highest id in use + 1, as in bash, but numbering starts from 0 rather than
+// bash's %1, so fg %0 names the first job.
+typedef enum {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} JobState;
+
+typedef struct {
+    int id;
+    pid_t pgid;         // process group of a pipeline, -1 for a command in the shell's group
+    pid_t *pids;
+    int pid_count;
+    int live_count;     // stages not reaped yet
+    int status;         // wait status of the last stage
+    int background;
+    int timed;          // print resource usage when the job is done
+    JobState state;
+    char *command;
+    struct timespec started;        // before the first stage was launched
+    struct timespec started_real;
+    double wall;                    // seconds from launch to the last stage being reaped
+    struct rusage usage;            // summed over all stages, ru_maxrss is the largest
+    FanOut *fanout;                 // ">|" copier thread, joined when the job is removed
+} Job;
+
+Job **job_slots = NULL;
+int job_slot_capacity = 0;
+int job_next_id = 0;
+int job_count = 0;
+int jobs_finished = 0;          // background jobs waiting to be reported
+struct timespec command_started;    // taken before launching, copied into new jobs
+int time_next_job = 0;              // set by the "time" prefix, consumed by job_create
+
+typedef struct {
+    pid_t pid;                  // 0 marks an empty slot
+    Job *job;
+} PidSlot;
+
+PidSlot *pid_map = NULL;
+unsigned int pid_map_capacity = 0;  // always a power of two
+unsigned int pid_map_count = 0;
+
+const char *job_state_names[] = { "Running", "Stopped", "Done" };
+
+unsigned int pid_hash(pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & (pid_map_capacity - 1);
+}
+
+void pid_map_insert(pid_t pid, Job *job);
+
+void pid_map_grow(void) {
+    PidSlot *old = pid_map;
+    unsigned int old_capacity = pid_map_capacity;
+
+    pid_map_capacity = old_capacity ? old_capacity * 2 : 64;
+    pid_map = calloc(pid_map_capacity, sizeof(PidSlot));
+    pid_map_count = 0;
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old[i].pid) {
+            pid_map_insert(old[i].pid, old[i].job);
+        }
+    }
+    free(old);
+}
+
+void pid_map_insert(pid_t pid, Job *job) {
+    if ((pid_map_count + 1) * 2 > pid_map_capacity) {
+        pid_map_grow();
+    }
+    unsigned int i = pid_hash(pid);
+    while (pid_map[i].pid) {
+        i = (i + 1) & (pid_map_capacity - 1);
+    }
+    pid_map[i].pid = pid;
+    pid_map[i].job = job;
+    pid_map_count++;
+}
+
+Job *job_find_pid(pid_t pid) {
+    if (!pid_map) {
+        return NULL;
+    }
+    for (unsigned int i = pid_hash(pid); pid_map[i].pid; i = (i + 1) & (pid_map_capacity - 1)) {
+        if (pid_map[i].pid == pid) {
+            return pid_map[i].job;
+        }
+    }
+    return NULL;
+}
+
+// Linear probing delete: shift later entries of the cluster back into the hole
+void pid_map_remove(pid_t pid) {
+    if (!pid_map) {
+        return;
+    }
+    unsigned int mask = pid_map_capacity - 1;
+    unsigned int i = pid_hash(pid);
+    while (pid_map[i].pid && pid_map[i].pid != pid) {
+        i = (i + 1) & mask;
+    }
+    if (!pid_map[i].pid) {
+        return;
+    }
+    pid_map[i].pid = 0;
+    pid_map_count--;
+
+    for (unsigned int j = (i + 1) & mask; pid_map[j].pid; j = (j + 1) & mask) {
+        unsigned int home = pid_hash(pid_map[j].pid);
+        // Move the entry if its home slot is not between the hole and its position
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            pid_map[i] = pid_map[j];
+            pid_map[j].pid = 0;
+            i = j;
+        }
+    }
+}
+
+Job *job_find(int id) {
+    if (id < 0 || id >= job_next_id) {
+        return NULL;
+    }
+    return job_slots[id];
+}
+
+Job *job_create(const char *command, pid_t pgid, int background) {
+    if (job_next_id == job_slot_capacity) {
+        job_slot_capacity = job_slot_capacity ? job_slot_capacity * 2 : 16;
+        job_slots = realloc(job_slots, job_slot_capacity * sizeof(Job *));
+    }
+
+    Job *job = calloc(1, sizeof(Job));
+    job->id = job_next_id++;
+    job->pgid = pgid;
+    job->background = background;
+    job->state = JOB_RUNNING;
+    job->command = strdup(command);
+    job->started = command_started;
+    clock_gettime(CLOCK_REALTIME, &job->started_real);
+    job->timed = time_next_job;
+    time_next_job = 0;
+    job_slots[job->id] = job;
+    job_count++;
+    return job;
+}
+
+void job_add_pid(Job *job, pid_t pid) {
+    job->pids = realloc(job->pids, (job->pid_count + 1) * sizeof(pid_t));
+    job->pids[job->pid_count++] = pid;
+    job->live_count++;
+    pid_map_insert(pid, job);
+}
+
+void job_remove(Job *job) {
+    for (int i = 0; i < job->pid_count; i++) {
+        pid_map_remove(job->pids[i]);
+    }
+    job_slots[job->id] = NULL;
+    while (job_next_id > 0 && !job_slots[job_next_id - 1]) {
+        job_next_id--;
+    }
+    job_count--;
+    if (job->fanout) {
+        fanout_finish(job->fanout);
+    }
+    free(job->pids);
+    free(job->command);
+    free(job);
+}
+
+// Resource accounting. wait4() hands back each stage's rusage as it is reaped;
+// the job sums them and, once done, its numbers go to the jobstats ring, to the
+// optional log file (one JSON object per line) and, for "time", to stderr.
+#define JOBSTATS_SIZE 128
+
+typedef struct {
+    int id;
+    int status;
+    int background;
+    int stages;
+    double wall;
+    struct timespec started_real;
+    struct rusage usage;
+    char *command;
+} JobStats;
+
+JobStats job_stats[JOBSTATS_SIZE];
+unsigned long job_stats_count = 0;      // total recorded, the ring keeps the newest
+FILE *job_stats_log = NULL;
+
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void rusage_add(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+}
+
+// A negative ru_maxrss means there is no peak to report
+void print_usage_report(FILE *out, double wall, const struct rusage *usage) {
+    fprintf(out, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n",
+            wall, timeval_seconds(usage->ru_utime), timeval_seconds(usage->ru_stime));
+    if (usage->ru_maxrss < 0) {
+        fprintf(out, "maxrss\tn/a\n");
+    } else {
+        fprintf(out, "maxrss\t%ld KB\n", usage->ru_maxrss);
+    }
+    fprintf(out, "ctxsw\t%ld voluntary, %ld involuntary\nfaults\t%ld minor, %ld major\n",
+            usage->ru_nvcsw, usage->ru_nivcsw, usage->ru_minflt, usage->ru_majflt);
+}
+
+void json_write_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void job_stats_write_log(JobStats *stats) {
+    FILE *out = job_stats_log;
+    fprintf(out, "{\"id\":%d,\"command\":", stats->id);
+    json_write_string(out, stats->command);
+    fprintf(out, ",\"start\":%ld.%06ld,\"background\":%d,\"stages\":%d",
+            (long)stats->started_real.tv_sec, stats->started_real.tv_nsec / 1000, stats->background, stats->stages);
+    if (WIFSIGNALED(stats->status)) {
+        fprintf(out, ",\"signal\":%d", WTERMSIG(stats->status));
+    } else {
+        fprintf(out, ",\"exit\":%d", WEXITSTATUS(stats->status));
+    }
+    fprintf(out, ",\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                 "\"nvcsw\":%ld,\"nivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"inblock\":%ld,\"oublock\":%ld}\n",
+            stats->wall, timeval_seconds(stats->usage.ru_utime), timeval_seconds(stats->usage.ru_stime),
+            stats->usage.ru_maxrss, stats->usage.ru_nvcsw, stats->usage.ru_nivcsw,
+            stats->usage.ru_minflt, stats->usage.ru_majflt, stats->usage.ru_inblock, stats->usage.ru_oublock);
+    fflush(out);
+}
+
+// Called once when the last stage of a job has been reaped
+void job_record_stats(Job *job) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job->wall = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+
+    JobStats *stats = &job_stats[job_stats_count++ % JOBSTATS_SIZE];
+    free(stats->command);
+    stats->id = job->id;
+    stats->status = job->status;
+    stats->background = job->background;
+    stats->stages = job->pid_count;
+    stats->wall = job->wall;
+    stats->started_real = job->started_real;
+    stats->usage = job->usage;
+    stats->command = strdup(job->command);
+
+    if (job_stats_log) {
+        job_stats_write_log(stats);
+    }
+    if (job->timed) {
+        if (job->background) {
+            fprintf(stderr, "[%d] %s\n", job->id, job->command);
+        }
+        print_usage_report(stderr, job->wall, &job->usage);
+    }
+}
+
+// Start appending finished jobs to path, or stop logging when path is NULL
+int job_stats_open_log(const char *path) {
+    if (job_stats_log) {
+        fclose(job_stats_log);
+        job_stats_log = NULL;
+    }
+    if (!path) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || !(job_stats_log = fdopen(fd, "a"))) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// jobstats builtin: list the most recent finished jobs, "-c" clears the list,
+// "-o file" starts logging to file and "-o -" stops logging
+int handle_jobstats_command(char **args) {
+    if (args[1] && strcmp(args[1], "-c") == 0) {
+        for (int i = 0; i < JOBSTATS_SIZE; i++) {
+            free(job_stats[i].command);
+            job_stats[i].command = NULL;
+        }
+        job_stats_count = 0;
+        return 1;
+    }
+    if (args[1] && strcmp(args[1], "-o") == 0) {
+        if (!args[2]) {
+            fprintf(stderr, "Usage: jobstats -o file|-\n");
+        } else {
+            job_stats_open_log(strcmp(args[2], "-") == 0 ? NULL : args[2]);
+        }
+        return 1;
+    }
+
+    printf("%-4s %-6s %10s %9s %9s %10s %7s %7s %8s %6s  %s\n",
+           "id", "status", "real", "user", "sys", "maxrss_kb", "vcsw", "ivcsw", "minflt", "majflt", "command");
+    unsigned long first = job_stats_count > JOBSTATS_SIZE ? job_stats_count - JOBSTATS_SIZE : 0;
+    for (unsigned long n = first; n < job_stats_count; n++) {
+        JobStats *stats = &job_stats[n % JOBSTATS_SIZE];
+        char status[16];
+        if (WIFSIGNALED(stats->status)) {
+            snprintf(status, sizeof(status), "sig%d", WTERMSIG(stats->status));
+        } else {
+            snprintf(status, sizeof(status), "%d", WEXITSTATUS(stats->status));
+        }
+        printf("%-4d %-6s %10.6f %9.6f %9.6f %10ld %7ld %7ld %8ld %6ld  %s\n",
+               stats->id, status, stats->wall,
+               timeval_seconds(stats->usage.ru_utime), timeval_seconds(stats->usage.ru_stime),
+               stats->usage.ru_maxrss, stats->usage.ru_nvcsw, stats->usage.ru_nivcsw,
+               stats->usage.ru_minflt, stats->usage.ru_majflt, stats->command);
+    }
+    return 1;
+}
+
+// Record a wait status reported for one of the job's processes
+void job_update(pid_t pid, int status, struct rusage *usage) {
+    Job *job = job_find_pid(pid);
+    if (!job) {
+        return;
+    }
+
+    if (WIFSTOPPED(status)) {
+        job->state = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        job->state = JOB_RUNNING;
+    } else {
+        pid_map_remove(pid);
+        rusage_add(&job->usage, usage);
+        job->live_count--;
+        if (pid == job->pids[job->pid_count - 1]) {
+            job->status = status;
+        }
+        if (job->live_count == 0) {
+            job->state = JOB_DONE;
+            job_record_stats(job);
+            if (job->background) {
+                jobs_finished++;
+            }
+        }
+    }
+}
+
+// Collect every child that changed state without blocking
+void reap_children(void) {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        job_update(pid, status, &usage);
+    }
+}
+
+// Block until some child changes state. Returns -1 when there are no children.
+int wait_child_event(void) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+    if (pid < 0) {
+        return -1;
+    }
+    job_update(pid, status, &usage);
+    return 0;
+}
+
+// Report and drop background jobs that finished since the last prompt
+// Print how a finished job ended and drop it from the table
+void job_report_done(Job *job) {
+    if (WIFEXITED(job->status) && WEXITSTATUS(job->status) != 0) {
+        printf("[%d] Exit %d\t%s\n", job->id, WEXITSTATUS(job->status), job->command);
+    } else if (WIFSIGNALED(job->status)) {
+        printf("[%d] Killed (%s)\t%s\n", job->id, strsignal(WTERMSIG(job->status)), job->command);
+    } else {
+        printf("[%d] Done\t%s\n", job->id, job->command);
+    }
+    job_remove(job);
+}
+
+void notify_jobs(void) {
+    if (jobs_finished == 0) {
+        return;
+    }
+    for (int id = 0; id < job_next_id; id++) {
+        Job *job = job_slots[id];
+        if (job && job->background && job->state == JOB_DONE) {
+            job_report_done(job);
+        }
+    }
+    jobs_finished = 0;
+}
+
+// Let a stopped job run again
+void job_continue(Job *job) {
+    if (job->state == JOB_DONE) {
+        return; // Reaped already; its pids may belong to other processes by now
+    }
+    if (job->pgid > 0) {
+        kill(-job->pgid, SIGCONT);
+    } else {
+        for (int i = 0; i < job->pid_count; i++) {
+            kill(job->pids[i], SIGCONT);
+        }
+    }
+    job->state = JOB_RUNNING;
+}
+
+// Wait in the foreground until the job finishes or is stopped. Other children
+// that change state meanwhile are recorded in the table as usual.
+void wait_for_job(Job *job) {
+    running_foreground_pid = job->pgid > 0 ? job->pgid : job->pids[0];
+    job->background = 0;
+
+    while (job->state == JOB_RUNNING) {
+        if (wait_child_event() < 0) {
+            break;
+        }
+    }
+
+    running_foreground_pid = -1;
+    if (job->pgid > 0) {
+        reclaim_terminal();
+    }
+
+    if (job->state == JOB_STOPPED) {
+        job->background = 1;
+        printf("\n[%d] Stopped\t%s\n", job->id, job->command);
+    } else {
+        job_remove(job);
+    }
+}
+
+// Either report a background job or wait for a foreground one
+void start_job(Job *job, int background) {
+    if (background) {
+        printf("[%d] Background process started: PID=%d\n", job->id, job->pgid > 0 ? job->pgid : job->pids[0]);
+    } else {
+        wait_for_job(job);
+    }
+}
+
+// Text used for a job in listings: the argv of every stage joined back together
+char *command_text(char ***stages, int stage_count) {
+    size_t length = 1;
+    for (int i = 0; i < stage_count; i++) {
+        for (int j = 0; stages[i][j]; j++) {
+            length += strlen(stages[i][j]) + 3;
+        }
+    }
+
+    char *text = malloc(length);
+    text[0] = '\0';
+    for (int i = 0; i < stage_count; i++) {
+        if (i > 0) strcat(text, " | ");
+        for (int j = 0; stages[i][j]; j++) {
+            if (j > 0) strcat(text, " ");
+            strcat(text, stages[i][j]);
+        }
+    }
+    return text;
+}
+
+// Parse "%n" or "n" into a job, reporting unknown ids
+Job *parse_job_spec(const char *spec) {
+    if (spec[0] == '%') {
+        spec++;
+    }
+    char *end;
+    long id = strtol(spec, &end, 10);
+    Job *job = (*spec && !*end) ? job_find((int)id) : NULL;
+    if (!job) {
+        fprintf(stderr, "Invalid job number\n");
+    }
+    return job;
+}
 
-#define MAX_ARGS 32
-#define MAX_LINE 128
-#define HISTORY_SIZE 10
+// jobs, fg, bg and wait builtins
+int handle_job_command(char **args) {
+    if (strcmp(args[0], "jobs") == 0) {
+        reap_children();
+        for (int id = 0; id < job_next_id; id++) {
+            Job *job = job_slots[id];
+            if (job) {
+                printf("[%d] %s\t%s\n", job->id, job_state_names[job->state], job->command);
+            }
+        }
+        notify_jobs();
+        return 1;
+    }
 
-// Function Prototypes
+    if (strcmp(args[0], "fg") == 0) {
+        if (!args[1]) {
+            fprintf(stderr, "Usage: fg %%num\n");
+            return 1;
+        }
+        Job *job = parse_job_spec(args[1]);
+        if (!job) {
+            return 1;
+        }
+        if (job->state == JOB_DONE) {
+            job_report_done(job); // Reaped, but not reported yet
+            return 1;
+        }
+        pid_t fg_pid = job->pgid > 0 ? job->pgid : job->pids[0];
+        printf("Foreground process started: PID %d\n", fg_pid);
+        if (job->pgid > 0 && shell_interactive) {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        }
+        job_continue(job);
 
-void parse_command(char *line, char **args, char **pipe_args, char **input_file, char **output_file, char **error_file, int *append_output, int *background);
-void execute_with_redirection(char **args, char *input_file, char *output_file, char *error_file, int append_output, int background);
-void execute_command(char **args, int background);
-int handle_internal_commands(char **args);
-char *find_executable(char *command);
-void execute_pipe_command(char **args1, char **args2); 
+        wait_for_job(job);
+        if (!job_find_pid(fg_pid)) {
+            printf("Process finished and removed in background list: PID %d\n", fg_pid);
+        }
+        return 1;
+    }
 
-pid_t running_foreground_pid = -1;
+    if (strcmp(args[0], "bg") == 0) {
+        if (!args[1]) {
+            fprintf(stderr, "Usage: bg %%num\n");
+            return 1;
+        }
+        Job *job = parse_job_spec(args[1]);
+        if (job && job->state == JOB_DONE) {
+            job_report_done(job);
+        } else if (job) {
+            job->background = 1;
+            job_continue(job);
+            printf("[%d] %s &\n", job->id, job->command);
+        }
+        return 1;
+    }
+
+    // wait: block until the given job, or every running background job, is done
+    if (args[1]) {
+        Job *job = parse_job_spec(args[1]);
+        while (job && job->state == JOB_RUNNING) {
+            if (wait_child_event() < 0) {
+                break;
+            }
+        }
+    } else {
+        int running = 1;
+        while (running) {
+            running = 0;
+            for (int id = 0; id < job_next_id && !running; id++) {
+                running = job_slots[id] && job_slots[id]->state == JOB_RUNNING;
+            }
+            if (running && wait_child_event() < 0) {
+                break;
+            }
+        }
+    }
+    notify_jobs();
+    return 1;
+}
 
-// Struct to keep track of background processes
+// parallel builtin: run a command template once per argument with at most -j
+// of them in flight, e.g. "parallel -j 8 -k gzip -9 {} ::: a b c". Arguments
+// come after ":::" or, without it, one per line from stdin. Each run's stdout is
+// captured in a memfd and printed when it finishes (-k keeps input order).
+// Runs go through the normal launch backend and job table like any other job.
 typedef struct {
-    pid_t pid;
-    char command[MAX_LINE];
-} BackgroundProcess;
+    Job *job;
+    int out_fd;
+    int status;
+    int done;
+} ParallelTask;
+
+double elapsed_seconds(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-BackgroundProcess bg_processes[MAX_ARGS];
-int bg_count = 0;
+// Substitute item for every "{}" in arg
+char *parallel_substitute(const char *arg, const char *item) {
+    size_t item_length = strlen(item);
+    size_t length = strlen(arg) + 1;
+    for (const char *p = strstr(arg, "{}"); p; p = strstr(p + 2, "{}")) {
+        length += item_length;
+    }
 
-char history[HISTORY_SIZE][MAX_LINE];
-int history_count = 0;
+    char *result = malloc(length);
+    char *out = result;
+    while (*arg) {
+        if (arg[0] == '{' && arg[1] == '}') {
+            memcpy(out, item, item_length);
+            out += item_length;
+            arg += 2;
+        } else {
+            *out++ = *arg++;
+        }
+    }
+    *out = '\0';
+    return result;
+}
 
-// Function to find executable in PATH
-char *find_executable(char *command) {
-    char *path = getenv("PATH");
-    if (!path) {
-        return NULL;
+// Copy a finished run's captured output to our stdout
+void parallel_flush(ParallelTask *task) {
+    if (task->out_fd < 0) {
+        return;
+    }
+    char buffer[65536];
+    ssize_t n;
+    lseek(task->out_fd, 0, SEEK_SET);
+    while ((n = read(task->out_fd, buffer, sizeof(buffer))) > 0) {
+        if (write(STDOUT_FILENO, buffer, n) != n) {
+            break;
+        }
     }
+    close(task->out_fd);
+    task->out_fd = -1;
+}
 
-    char *path_copy = strdup(path);
-    char *dir;
-    static char full_path[4096];
-    dir = strtok(path_copy, ":");
+void parallel_launch(ParallelTask *task, char *executable, char **template, int template_count, char *item) {
+    int substituted = 0;
+    for (int i = 0; i < template_count; i++) {
+        substituted |= strstr(template[i], "{}") != NULL;
+    }
 
-    while (dir) {
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir, command);
-        if (access(full_path, X_OK) == 0) {
-            free(path_copy);
-            return full_path;
+    char **argv = malloc((template_count + 2) * sizeof(char *));
+    for (int i = 0; i < template_count; i++) {
+        argv[i] = parallel_substitute(template[i], item);
+    }
+    int argc = template_count;
+    if (!substituted) {
+        argv[argc++] = strdup(item);
+    }
+    argv[argc] = NULL;
+
+    task->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+    task->job = NULL;
+    task->done = 0;
+
+    LaunchSpec spec;
+    launch_spec_init(&spec);
+    spec.out_fd = task->out_fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &command_started);
+    pid_t pid = executable ? launch_process(executable, argv, &spec) : -1;
+    if (pid > 0) {
+        char *text = command_text(&argv, 1);
+        task->job = job_create(text, -1, 0);
+        free(text);
+        job_add_pid(task->job, pid);
+    } else {
+        fprintf(stderr, "parallel: cannot run %s: %s\n", template[0], executable ? strerror(errno) : "command not found");
+        task->status = 127 << 8;
+        task->done = 1;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+int handle_parallel_command(char **args) {
+    long job_limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0;
+    int a = 1;
+
+    for (; args[a] && args[a][0] == '-'; a++) {
+        if (strcmp(args[a], "-k") == 0) {
+            keep_order = 1;
+        } else if (strcmp(args[a], "-j") == 0 && args[a + 1]) {
+            job_limit = atol(args[++a]);
+        } else if (strncmp(args[a], "-j", 2) == 0 && args[a][2]) {
+            job_limit = atol(args[a] + 2);
+        } else {
+            break;
         }
-        dir = strtok(NULL, ":");
     }
 
-    free(path_copy);
-    return NULL;
+    char **template = &args[a];
+    int template_count = 0;
+    while (template[template_count] && strcmp(template[template_count], ":::") != 0) {
+        template_count++;
+    }
+    if (template_count == 0 || job_limit < 1) {
+        fprintf(stderr, "Usage: parallel [-j N] [-k] command [args with {}] [::: items...]\n");
+        return 1;
+    }
+
+    // Items come from the command line after ":::" or from stdin, one per line
+    char **items = NULL;
+    int item_count = 0;
+    int item_capacity = 0;
+    int owned_items = 0;
+    if (template[template_count]) {
+        items = &template[template_count + 1];
+        while (items[item_count]) {
+            item_count++;
+        }
+    } else {
+        // A reader of its own, so the shell's reader keeps its buffered lines and
+        // does not see end of file: the shell goes on with its next command
+        InputReader stdin_reader;
+        reader_init(&stdin_reader, STDIN_FILENO);
+        char *line;
+        owned_items = 1;
+        while ((line = reader_getline(&stdin_reader)) != NULL) {
+            if (item_count == item_capacity) {
+                item_capacity = item_capacity ? item_capacity * 2 : 64;
+                items = realloc(items, item_capacity * sizeof(char *));
+            }
+            items[item_count++] = strdup(line);
+        }
+        reader_free(&stdin_reader);
+    }
+
+    char *executable = find_executable(template[0]);
+    ParallelTask *tasks = calloc(item_count ? item_count : 1, sizeof(ParallelTask));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int next = 0;           // next item to launch
+    int running = 0;
+    int finished = 0;
+    int printed = 0;        // -k: items up to here have been written out
+    int failed = 0;
+
+    fflush(stdout);
+    while (finished < item_count) {
+        while (running < job_limit && next < item_count) {
+            parallel_launch(&tasks[next], executable, template, template_count, items[next]);
+            if (tasks[next].done) {
+                finished++;
+                failed++;
+                if (!keep_order) parallel_flush(&tasks[next]);
+            } else {
+                running++;
+            }
+            next++;
+        }
+
+        if (running > 0 && wait_child_event() < 0) {
+            break;
+        }
+
+        for (int i = keep_order ? printed : 0; i < next; i++) {
+            ParallelTask *task = &tasks[i];
+            if (task->done || !task->job || task->job->state != JOB_DONE) {
+                continue;
+            }
+            task->status = task->job->status;
+            task->done = 1;
+            job_remove(task->job);
+            task->job = NULL;
+            running--;
+            finished++;
+            if (!WIFEXITED(task->status) || WEXITSTATUS(task->status) != 0) {
+                failed++;
+            }
+            if (!keep_order) {
+                parallel_flush(task);
+            }
+        }
+
+        while (keep_order && printed < next && tasks[printed].done) {
+            parallel_flush(&tasks[printed++]);
+        }
+    }
+
+    double wall = elapsed_seconds(&start);
+    for (int i = 0; i < item_count; i++) {
+        int status = tasks[i].status;
+        if (tasks[i].done && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "parallel: %s: killed by %s\n", items[i], strsignal(WTERMSIG(status)));
+            } else {
+                fprintf(stderr, "parallel: %s: exit %d\n", items[i], WEXITSTATUS(status));
+            }
+        }
+        if (tasks[i].out_fd >= 0) close(tasks[i].out_fd);
+        if (owned_items) free(items[i]);
+    }
+    fprintf(stderr, "parallel: %d jobs, %d failed, %.3f s wall, %.1f jobs/s (-j %ld)\n",
+            item_count, failed, wall, wall > 0 ? item_count / wall : 0.0, job_limit);
+
+    free(tasks);
+    if (owned_items) free(items);
+    return 1;
 }
 
-// Execute a command using execv
+// Execute a command using the selected launch backend
 void execute_command(char **args, int background) {
     char *executable = find_executable(args[0]);
     if (!executable) {
@@ -69,45 +2317,60 @@ void execute_command(char **args, int background) {
         return;
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0) { // Child process
-        signal(SIGTSTP, SIG_DFL); 
-        
-        if (execv(executable, args) == -1) {
-            perror("Exec failed");
-            exit(EXIT_FAILURE);
-        }
-    } else if (pid > 0) { // Parent process
-        if (background) {
-            printf("Background process started: PID=%d\n", pid);
-            bg_processes[bg_count].pid = pid;
-            snprintf(bg_processes[bg_count].command, MAX_LINE, "%s", args[0]);
-            bg_count++;
-        } else {
-            running_foreground_pid = pid;
-            int status;
-            waitpid(pid, &status, WUNTRACED);
-
-            if (WIFSTOPPED(status)) {
-                // İşlem durduruldu
-                bg_processes[bg_count].pid = pid;
-                snprintf(bg_processes[bg_count].command, MAX_LINE, "Suspended process");
-                bg_count++;
-            }
+    LaunchSpec spec;
+    launch_spec_init(&spec);
+    pid_t pid = launch_process(executable, args, &spec);
 
-            running_foreground_pid = -1;
-        }
+    if (pid > 0) { // Parent process
+        char *text = command_text(&args, 1);
+        Job *job = job_create(text, -1, background);
+        free(text);
+        job_add_pid(job, pid);
+        start_job(job, background);
     } else {
-        perror("Fork failed");
+        perror("Launch failed");
     }
 }
 
 
 
+const char *internal_commands[] = {
+    "hash", "spawnmode", "pipesize", "jobs", "fg", "bg", "wait", "jobstats", "parallel", "exit", "history", NULL
+};
+
+int is_internal_command(const char *name) {
+    for (int i = 0; internal_commands[i]; i++) {
+        if (strcmp(name, internal_commands[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 int handle_internal_commands(char **args) {
+    if (strcmp(args[0], "hash") == 0) {
+        return handle_hash_command(args);
+    }
+    if (strcmp(args[0], "spawnmode") == 0) {
+        return handle_spawnmode_command(args);
+    }
+    if (strcmp(args[0], "pipesize") == 0) {
+        return handle_pipesize_command(args);
+    }
+    if (strcmp(args[0], "jobs") == 0 || strcmp(args[0], "fg") == 0 ||
+        strcmp(args[0], "bg") == 0 || strcmp(args[0], "wait") == 0) {
+        return handle_job_command(args);
+    }
+    if (strcmp(args[0], "jobstats") == 0) {
+        return handle_jobstats_command(args);
+    }
+    if (strcmp(args[0], "parallel") == 0) {
+        return handle_parallel_command(args);
+    }
     if (strcmp(args[0], "exit") == 0) {
-        if (bg_count > 0) {
+        reap_children();
+        notify_jobs();
+        if (job_count > 0) {
             fprintf(stderr, "Cannot exit: Background processes are running.\n");
             return 1;
         }
@@ -116,47 +2379,24 @@ int handle_internal_commands(char **args) {
         if (args[1] && strcmp(args[1], "-i") == 0) {
             if (args[2]) {
                 int index = atoi(args[2]);
-                if (index >= 0 && index < history_count) {
-                    printf("Executing history[%d]: %s", index, history[index]);
-
-                    
-                    char *history_line = strdup(history[index]);
-                    char *history_args[MAX_ARGS];
-                    char *pipe_args[MAX_ARGS];
-                    char *input_file, *output_file, *error_file;
-                    int append_output, background;
-
-                   
-                    parse_command(history_line, history_args, pipe_args, &input_file, &output_file, &error_file, &append_output, &background);
-
-                  
-                    if (pipe_args[0] != NULL) {
-                        execute_pipe_command(history_args, pipe_args);
-                    } else if (input_file || output_file || error_file) {
-                        execute_with_redirection(history_args, input_file, output_file, error_file, append_output, background);
-                    } else {
-                        execute_command(history_args, background);
-                    }
+                uint64_t next = history_next_seq();
+                char history_line[HISTORY_TEXT_SIZE];
+                int status = index >= 0 && (uint64_t)index < next - history_first_seq() ?
+                             history_get(next - 1 - index, history_line) : -1;
+                if (status > 0) {
+                    fprintf(stderr, "history[%d] was too long to keep in full; not running it\n", index);
+                    return 1;
+                }
+                if (status == 0) {
+                    printf("Executing history[%d]: %s\n", index, history_line);
 
-                    free(history_line);
-           
-                    if (history_count < HISTORY_SIZE) {
-                        // Diziyi aşağı kaydır
-                        for (int i = history_count; i > 0; i--) {
-                            strcpy(history[i], history[i - 1]);
-                        }
-                        // Çalıştırılan komutu başa ekle
-                        strcpy(history[0], history[index]);
-                        history_count++;
-                    } else {
-                        // Diziyi aşağı kaydır
-                        for (int i = HISTORY_SIZE - 1; i > 0; i--) {
-                            strcpy(history[i], history[i - 1]);
-                        }
-                        // Çalıştırılan komutu başa ekle
-                        strcpy(history[0], history[index]);
-                    }
+                    // Çalıştırılan komutu başa ekle
+                    history_add(history_line);
 
+                    Command history_cmd;
+                    if (parse_command(&command_arena, history_line, &history_cmd) == 0 && history_cmd.stage_count > 0) {
+                        execute_parsed_command(&history_cmd);
+                    }
                     return 1;
                 } else {
                     fprintf(stderr, "Invalid history index: %s\n", args[2]);
@@ -166,107 +2406,244 @@ int handle_internal_commands(char **args) {
                 fprintf(stderr, "Usage: history -i num\n");
                 return 1;
             }
+        } else if (args[1] && (strcmp(args[1], "-s") == 0 || strcmp(args[1], "-p") == 0)) {
+            if (args[2]) {
+                history_search(args[2], args[1][1] == 'p');
+            } else {
+                fprintf(stderr, "Usage: history -s text | history -p prefix\n");
+            }
+            return 1;
         } else {
-            
-            for (int i = 0; i < history_count; i++) {
-                printf("%d %s", i, history[i]);
+            int count = args[1] && strcmp(args[1], "-n") == 0 && args[2] ? atoi(args[2]) : HISTORY_SIZE;
+            uint64_t next = history_next_seq();
+            uint64_t first = history_first_seq();
+            char text[HISTORY_TEXT_SIZE];
+            for (int i = 0; i < count && next - i > first; i++) {
+                int status = history_get(next - 1 - i, text);
+                if (status >= 0) {
+                    printf("%d %s%s\n", i, text, status > 0 ? "..." : "");
+                }
             }
             return 1;
         }
     } 
-   if (strcmp(args[0], "fg") == 0 && args[1]) {
-        int job_num = atoi(args[1] + 1);  // %num şeklinde gelen komutları işlemek için
-        if (job_num < bg_count && job_num >= 0) {
-            pid_t fg_pid = bg_processes[job_num].pid;
+    return 0;
+    }
 
-            // Foreground'a al
-            running_foreground_pid = fg_pid;
-            kill(fg_pid, SIGCONT);  // Foreground işlemi başlat
+// Tokens produced by tokenize_line
+typedef enum {
+    TOKEN_WORD,
+    TOKEN_PIPE,         // |
+    TOKEN_INPUT,        // <
+    TOKEN_OUTPUT,       // >
+    TOKEN_APPEND,       // >>
+    TOKEN_ERROR,        // 2>
+    TOKEN_TEE,          // >|
+    TOKEN_BACKGROUND    // &
+} TokenType;
 
-            printf("Foreground process started: PID %d\n", fg_pid);
+typedef struct {
+    TokenType type;
+    char *text;         // unquoted word, NULL for operators
+} Token;
+
+// Split line into words and operators. Words may contain '...' (taken
+// literally), "..." (where \ escapes \, " and $) and \x outside quotes; quoted
+// operator characters are plain text. Tokens and their text live in arena.
+// Returns the token count, or -1 on an unterminated quote.
+int tokenize_line(Arena *arena, const char *line, Token **tokens_out) {
+    size_t length = strlen(line);
+    // A line of n characters has at most n tokens whose text (with terminators)
+    // fits in 2n + 1 bytes
+    Token *tokens = arena_alloc(arena, (length + 1) * sizeof(Token));
+    char *out = arena_alloc(arena, 2 * length + 2);
+    int count = 0;
+    const char *p = line;
 
-            // Foreground işlemi bitene kadar bekle
-            int status;
-            waitpid(fg_pid, &status, WUNTRACED);  // İşlem duraklatılabilir
+    while (1) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
 
-            // Duraklatma sonrası, shell prompt'u yeniden görünmeli
-            if (WIFSTOPPED(status)) {
-                // İşlem duraklatıldıysa, foreground'a alındığında shell çalışmaya devam etmeli
-                printf("Foreground process (PID %d) stopped. Returning to prompt...\n", fg_pid);
-            } else if (WIFEXITED(status)) {
-                printf("Foreground process (PID %d) exited normally.\n", fg_pid);
+        Token *token = &tokens[count++];
+        token->text = NULL;
+        if (*p == '|') {
+            token->type = TOKEN_PIPE;
+            p++;
+            continue;
+        } else if (*p == '<') {
+            token->type = TOKEN_INPUT;
+            p++;
+            continue;
+        } else if (*p == '>') {
+            if (p[1] == '|') {
+                token->type = TOKEN_TEE;
+                p += 2;
+            } else {
+                token->type = p[1] == '>' ? TOKEN_APPEND : TOKEN_OUTPUT;
+                p += p[1] == '>' ? 2 : 1;
             }
+            continue;
+        } else if (p[0] == '2' && p[1] == '>') {
+            token->type = TOKEN_ERROR;
+            p += 2;
+            continue;
+        } else if (*p == '&') {
+            token->type = TOKEN_BACKGROUND;
+            p++;
+            continue;
+        }
 
-            if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                // Process listeden tamamen sil
-                for (int i = job_num; i < bg_count - 1; i++) {
-                    bg_processes[i] = bg_processes[i + 1];
+        token->type = TOKEN_WORD;
+        token->text = out;
+        while (*p && !strchr(" \t\n|<>&", *p)) {
+            if (*p == '\'') {
+                const char *end = strchr(p + 1, '\'');
+                if (!end) {
+                    fprintf(stderr, "Syntax error: unterminated quote\n");
+                    return -1;
                 }
-                bg_count--;
-                printf("Process finished and removed in background list: PID %d\n", fg_pid);
+                memcpy(out, p + 1, end - p - 1);
+                out += end - p - 1;
+                p = end + 1;
+            } else if (*p == '"') {
+                p++;
+                while (*p && *p != '"') {
+                    if (*p == '\\' && (p[1] == '\\' || p[1] == '"' || p[1] == '$')) {
+                        p++;
+                    }
+                    *out++ = *p++;
+                }
+                if (!*p) {
+                    fprintf(stderr, "Syntax error: unterminated quote\n");
+                    return -1;
+                }
+                p++;
+            } else if (*p == '\\' && p[1]) {
+                *out++ = p[1];
+                p += 2;
+            } else {
+                *out++ = *p++;
             }
-
-            running_foreground_pid = -1;  // Foreground pid'yi sıfırla
-        } else {
-            fprintf(stderr, "Invalid job number\n");
         }
-        return 1;
-    }
-    return 0;
+        *out++ = '\0';
     }
 
-// Parse input and handle redirection
-void parse_command(char *line, char **args, char **pipe_args, char **input_file, char **output_file, char **error_file, int *append_output, int *background) {
-    *input_file = NULL;
-    *output_file = NULL;
-    *error_file = NULL;
-    *append_output = 0;
-    *background = 0;
-
+    *tokens_out = tokens;
+    return count;
+}
 
-    char *pipe_pos = strchr(line, '|');
-    if (pipe_pos) {
-        *pipe_pos = '\0'; 
-        pipe_pos++;       
+// Parse input and handle redirection. Stages are separated by '|'; their argv
+// vectors are stored back to back in one array, each terminated by NULL.
+// Everything, including the stage table, is allocated in arena.
+int parse_command(Arena *arena, const char *line, Command *cmd) {
+    cmd->stage_count = 0;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->error_file = NULL;
+    cmd->error_stage = 0;
+    cmd->append_output = 0;
+    cmd->background = 0;
+    cmd->timed = 0;
+    memset(&cmd->options, 0, sizeof(cmd->options));
+    cmd->tee_files = NULL;
+    cmd->tee_count = 0;
+    cmd->tee_stage = 0;
+
+    Token *tokens;
+    int count = tokenize_line(arena, line, &tokens);
+    if (count <= 0) {
+        return count;
+    }
 
-       
-        char *token = strtok(pipe_pos, " \t\n");
-        int j = 0;
-        while (token != NULL) {
-            pipe_args[j++] = token;
-            token = strtok(NULL, " \t\n");
-        }
-        pipe_args[j] = NULL;
-    } else {
-        pipe_args[0] = NULL; 
+    int pipes = 0;
+    for (int t = 0; t < count; t++) {
+        pipes += tokens[t].type == TOKEN_PIPE;
     }
+    char **args = arena_alloc(arena, (count + pipes + 1) * sizeof(char *));
+    cmd->stages = arena_alloc(arena, (pipes + 1) * sizeof(char **));
+    cmd->tee_files = arena_alloc(arena, count * sizeof(char *));
 
     int i = 0;
-    char *token = strtok(line, " \t\n");
-
-    while (token != NULL) {
-        if (strcmp(token, "<") == 0) {
-            token = strtok(NULL, " \t\n");
-            *input_file = token;
-        } else if (strcmp(token, ">") == 0) {
-            token = strtok(NULL, " \t\n");
-            *output_file = token;
-            *append_output = 0;
-        } else if (strcmp(token, ">>") == 0) {
-            token = strtok(NULL, " \t\n");
-            *output_file = token;
-            *append_output = 1;
-        } else if (strcmp(token, "2>") == 0) {
-            token = strtok(NULL, " \t\n");
-            *error_file = token;
-        } else if (strcmp(token, "&") == 0) {
-            *background = 1;
+    int start = 0;
+    int in_options = 0;
+    for (int t = 0; t <= count; t++) {
+        TokenType type = t < count ? tokens[t].type : TOKEN_PIPE;
+
+        if (type == TOKEN_WORD) {
+            // Prefixes before the first word of the command are not part of it
+            char *text = tokens[t].text;
+            if (i == 0 && strcmp(text, "time") == 0 && t + 1 < count) {
+                cmd->timed = 1;
+                continue;
+            }
+            if (i == 0 && (text[0] == '@' || (in_options && is_launch_option(text)))) {
+                if (parse_launch_option(text[0] == '@' ? text + 1 : text, &cmd->options) != 0) {
+                    return -1;
+                }
+                in_options = 1;
+                continue;
+            }
+            args[i++] = text;
+        } else if (type == TOKEN_PIPE) {
+            // End of a stage
+            if (i == start) {
+                if (t < count || cmd->stage_count > 0) {
+                    fprintf(stderr, "Syntax error: empty pipeline stage\n");
+                    return -1;
+                }
+                break;
+            }
+            args[i++] = NULL;
+            cmd->stages[cmd->stage_count++] = &args[start];
+            start = i;
+        } else if (type == TOKEN_BACKGROUND) {
+            cmd->background = 1;
         } else {
-            args[i++] = token;
+            if (t + 1 >= count || tokens[t + 1].type != TOKEN_WORD) {
+                fprintf(stderr, "Syntax error: missing file name for redirection\n");
+                return -1;
+            }
+            char *file = tokens[++t].text;
+            if (type == TOKEN_INPUT) {
+                cmd->input_file = file;
+            } else if (type == TOKEN_ERROR) {
+                cmd->error_file = file;
+                cmd->error_stage = cmd->stage_count;
+            } else if (type == TOKEN_TEE) {
+                if (cmd->tee_count > 0 && cmd->tee_stage != cmd->stage_count) {
+                    fprintf(stderr, "Syntax error: >| targets must all follow the same stage\n");
+                    return -1;
+                }
+                cmd->tee_stage = cmd->stage_count;
+                cmd->tee_files[cmd->tee_count++] = file;
+            } else {
+                cmd->output_file = file;
+                cmd->append_output = type == TOKEN_APPEND;
+            }
         }
-        token = strtok(NULL, " \t\n");
     }
-    args[i] = NULL;
+    return 0;
+}
+
+// Run a parsed line through the matching execution path
+void execute_parsed_command(Command *cmd) {
+    char **args = cmd->stages[0];
+
+    clock_gettime(CLOCK_MONOTONIC, &command_started);
+    time_next_job = cmd->timed;
+    launch_options = launch_options_set(&cmd->options) ? &cmd->options : NULL;
+
+    if (cmd->stage_count > 1 || cmd->tee_count > 0) {
+        execute_pipe_command(cmd);
+    } else if (cmd->input_file || cmd->output_file || cmd->error_file) {
+        execute_with_redirection(args, cmd->input_file, cmd->output_file, cmd->error_file, cmd->append_output, cmd->background);
+    } else {
+        execute_command(args, cmd->background);
+    }
 }
 
 // Execute command with redirection
@@ -277,109 +2654,177 @@ void execute_with_redirection(char **args, char *input_file, char *output_file,
         return;
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0) { // Child process
-        if (input_file) {
-            int fd_in = open(input_file, O_RDONLY);
-            if (fd_in < 0) {
-                perror("Error opening input file");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
-        }
-
-        if (output_file) {
-            int fd_out = open(output_file, O_WRONLY | O_CREAT | (append_output ? O_APPEND : O_TRUNC), 0644);
-            if (fd_out < 0) {
-                perror("Error opening output file");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd_out, STDOUT_FILENO);
-            close(fd_out);
-        }
+    LaunchSpec spec;
+    launch_spec_init(&spec);
+    if (open_redirections(&spec, input_file, output_file, error_file, append_output) != 0) {
+        return;
+    }
 
-        if (error_file) {
-            int fd_err = open(error_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd_err < 0) {
-                perror("Error opening error file");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd_err, STDERR_FILENO);
-            close(fd_err);
-        }
+    pid_t pid = launch_process(executable, args, &spec);
+    launch_spec_close_files(&spec);
 
-        execv(executable, args);
-        perror("Exec failed");
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) { // Parent process
-        if (background) {
-            printf("Background process started: PID=%d\n", pid);
-            bg_processes[bg_count].pid = pid;
-            snprintf(bg_processes[bg_count].command, MAX_LINE, "%s", args[0]);
-            bg_count++;
-        } else {
-            waitpid(pid, NULL, 0);
-        }
+    if (pid > 0) { // Parent process
+        char *text = command_text(&args, 1);
+        Job *job = job_create(text, -1, background);
+        free(text);
+        job_add_pid(job, pid);
+        start_job(job, background);
     } else {
-        perror("Fork failed");
+        perror("Launch failed");
     }
 }
-void execute_pipe_command(char **args1, char **args2) {
-    char *executable1 = find_executable(args1[0]);
-    char *executable2 = find_executable(args2[0]);
 
-    if (!executable1) {
-        fprintf(stderr, "Command not found: %s\n", args1[0]);
-        return;
+// Execute an N-stage pipeline. All pipes are created and all stages launched
+// before the shell waits on anything; the stages share one process group led
+// by the first stage so they can be stopped, resumed and reaped as a unit.
+void execute_pipe_command(Command *cmd) {
+    int n = cmd->stage_count;
+    char **executables = arena_alloc(&command_arena, n * sizeof(char *));
+
+    for (int i = 0; i < n; i++) {
+        // Resolved paths stay valid across lookups since they live in the cache
+        executables[i] = find_executable(cmd->stages[i][0]);
+        if (!executables[i]) {
+            fprintf(stderr, "Command not found: %s\n", cmd->stages[i][0]);
+            return;
+        }
     }
 
-    if (!executable2) {
-        fprintf(stderr, "Command not found: %s\n", args2[0]);
+    LaunchSpec files;
+    launch_spec_init(&files);
+    if (open_redirections(&files, cmd->input_file, cmd->output_file, cmd->error_file, cmd->append_output) != 0) {
         return;
     }
 
-    int pipe_fd[2];
-    if (pipe(pipe_fd) == -1) {
-        perror("Pipe failed");
-        return;
+    int (*pipes)[2] = arena_alloc(&command_arena, n * sizeof(*pipes));
+    int pipe_count = 0;
+    for (; pipe_count < n - 1; pipe_count++) {
+        if (pipe2(pipes[pipe_count], O_CLOEXEC) == -1) {
+            perror("Pipe failed");
+            break;
+        }
+        if (pipe_buffer_size > 0 && fcntl(pipes[pipe_count][1], F_SETPIPE_SZ, pipe_buffer_size) == -1) {
+            perror("Pipe resize failed");
+        }
+    }
+
+    // The ">|" stage writes into the fan-out pipe instead of its own stdout
+    int ready = pipe_count == n - 1;
+    FanOut *fan = NULL;
+    int tee_out = -1;
+    if (cmd->tee_count > 0 && ready) {
+        int downstream = cmd->tee_stage == n - 1 ? files.out_fd : pipes[cmd->tee_stage][1];
+        fan = fanout_create(cmd->tee_files, cmd->tee_count, downstream, &tee_out);
+        ready = fan != NULL;
     }
 
-    pid_t pid1 = fork();
-    if (pid1 == 0) { // Child process for the first command
-        close(pipe_fd[0]); // Close unused read end of the pipe
-        dup2(pipe_fd[1], STDOUT_FILENO); // Redirect stdout to the pipe write end
-        close(pipe_fd[1]); // Close the pipe after duplicating
+    Job *job = NULL;
+    pid_t pgid = 0;
+
+    if (ready) {
+        for (int i = 0; i < n; i++) {
+            LaunchSpec spec;
+            launch_spec_init(&spec);
+            spec.in_fd = (i == 0) ? files.in_fd : pipes[i - 1][0];
+            spec.out_fd = (i == n - 1) ? files.out_fd : pipes[i][1];
+            if (i == cmd->error_stage) {
+                spec.err_fd = files.err_fd;
+            }
+            if (fan && i == cmd->tee_stage) {
+                spec.out_fd = tee_out;
+            }
+            spec.pgid = pgid;
+            spec.foreground = !cmd->background;
 
-        if (execv(executable1, args1) == -1) {
-            perror("Exec failed for first command");
-            exit(EXIT_FAILURE);
+            pid_t pid = launch_process(executables[i], cmd->stages[i], &spec);
+            if (pid < 0) {
+                fprintf(stderr, "Launch failed for %s: %s\n", cmd->stages[i][0], strerror(errno));
+                continue;
+            }
+            join_process_group(pid, &spec);
+            if (!job) {
+                pgid = pid;
+                char *text = command_text(cmd->stages, n);
+                job = job_create(text, pgid, cmd->background);
+                free(text);
+            }
+            job_add_pid(job, pid);
         }
     }
 
-    pid_t pid2 = fork();
-    if (pid2 == 0) { // Child process for the second command
-        close(pipe_fd[1]); // Close unused write end of the pipe
-        dup2(pipe_fd[0], STDIN_FILENO); // Redirect stdin to the pipe read end
-        close(pipe_fd[0]); // Close the pipe after duplicating
+    // The stages hold their own copies now
+    for (int i = 0; i < pipe_count; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    launch_spec_close_files(&files);
 
-        if (execv(executable2, args2) == -1) {
-            perror("Exec failed for second command");
-            exit(EXIT_FAILURE);
+    if (fan) {
+        close(tee_out);
+        if (job && fanout_start(fan) == 0) {
+            job->fanout = fan;
+        } else {
+            fanout_free(fan);
         }
     }
 
-    close(pipe_fd[0]);
-    close(pipe_fd[1]);
-
-    waitpid(pid1, NULL, 0); // Wait for the first process to complete
-    waitpid(pid2, NULL, 0); // Wait for the second process to complete
+    if (job) {
+        start_job(job, cmd->background);
+    }
 }
 
+// pipesize builtin: show or set the buffer size of pipeline pipes (F_SETPIPE_SZ)
+int handle_pipesize_command(char **args) {
+    if (!args[1]) {
+        if (pipe_buffer_size > 0) {
+            printf("pipesize: %d\n", pipe_buffer_size);
+        } else {
+            printf("pipesize: default\n");
+        }
+        return 1;
+    }
+    pipe_buffer_size = atoi(args[1]);
+    if (pipe_buffer_size < 0) {
+        pipe_buffer_size = 0;
+    }
+    return 1;
+}
 
-
-
+// Event loop body: sleep in poll() until stdin has input, reaping children and
+// reporting finished jobs whenever SIGCHLD arrives in the meantime.
+int wait_for_input(InputReader *reader) {
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_fd;
+    fds[1].events = POLLIN;
+
+    // Lines already sitting in the reader's buffer are invisible to poll
+    while (!reader_has_line(reader)) {
+        if (poll(fds, signal_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            reap_children();
+            if (jobs_finished > 0) {
+                printf("\n");
+                notify_jobs();
+                printf("myshell: ");
+                fflush(stdout);
+            }
+        }
+        if (fds[0].revents) {
+            break;
+        }
+    }
+    return 0;
+}
 
 void sigtstp_handler(int sig) {
     if (running_foreground_pid > 0) {
@@ -393,54 +2838,152 @@ void sigtstp_handler(int sig) {
 }
 
 
-int main() {
+void print_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t] [-c command | script]\n", name);
+}
+
+int main(int argc, char *argv[]) {
     signal(SIGTSTP, sigtstp_handler);
 
-    char line[MAX_LINE];
-    char *args[MAX_ARGS], *pipe_args[MAX_ARGS];
-    char *input_file, *output_file, *error_file;
-    int append_output, background;
+    // myshell            interactive, prompt per line
+    // myshell -c text    run the lines in text and exit
+    // myshell script     run the lines of a file and exit
+    // -t reports the total run time and time per command on stderr at exit
+    char *command_string = NULL;
+    char *script = NULL;
+    int report_time = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            report_time = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            command_string = argv[++i];
+        } else if (argv[i][0] != '-' && !script && !command_string) {
+            script = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    int batch = command_string || script;
+
+    // While the shell is still small; see zygote_start
+    zygote_start();
+
+    if (command_string) {
+        reader_init_string(&shell_input, command_string);
+    } else if (script) {
+        int fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(script);
+            return EXIT_FAILURE;
+        }
+        reader_init(&shell_input, fd);
+    } else {
+        reader_init(&shell_input, STDIN_FILENO);
+    }
+
+    history_open();
+
+    char *stats_log = getenv("MYSHELL_STATS_LOG");
+    if (stats_log) {
+        job_stats_open_log(stats_log);
+    }
+
+    char *pipe_size = getenv("MYSHELL_PIPE_SIZE");
+    if (pipe_size) {
+        pipe_buffer_size = atoi(pipe_size);
+    }
+
+    // Pipelines get the terminal while they run; the shell must not be stopped
+    // for touching it while it is handing it back and forth.
+    shell_interactive = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    if (shell_interactive) {
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+    }
+
+    // Children are reaped from the event loop: SIGCHLD is blocked and read from
+    // a signalfd polled together with stdin, so finished background jobs are
+    // collected (and reported) as soon as they exit, even while idle at the prompt.
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+    signal_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd failed");
+    }
+
+    char *mode = getenv("MYSHELL_SPAWN");
+    if (mode && set_spawn_mode(mode) != 0) {
+        fprintf(stderr, "Unknown MYSHELL_SPAWN mode '%s', using %s\n", mode, spawn_mode_names[spawn_mode]);
+    }
+
+    char *line;
+    Command cmd;
+    unsigned long command_count = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     while (1) {
-        printf("myshell: ");
-        if (!fgets(line, sizeof(line), stdin)) {
+        reap_children();
+        notify_jobs();
+        if (!batch) {
+            printf("myshell: ");
+            fflush(stdout);
+            if (wait_for_input(&shell_input) < 0) {
+                break;
+            }
+        }
+        if ((line = reader_getline(&shell_input)) == NULL) {
             break;
         }
 
         if (strncmp(line, "history", 7) != 0) { // Eğer ilk kelime "history" değilse kaydet
-            if (history_count < HISTORY_SIZE) {
-                for (int i = history_count; i > 0; i--) {
-                    strcpy(history[i], history[i - 1]);
-                }
-                strcpy(history[0], line);
-                history_count++;
-            } else {
-                for (int i = HISTORY_SIZE - 1; i > 0; i--) {
-                    strcpy(history[i], history[i - 1]);
-                }
-                strcpy(history[0], line);
-            }
+            history_add(line);
         }
 
-        parse_command(line, args, pipe_args, &input_file, &output_file, &error_file, &append_output, &background);
-
-        if (args[0] == NULL) {
+        arena_reset(&command_arena);
+        if (parse_command(&command_arena, line, &cmd) != 0 || cmd.stage_count == 0) {
             continue;
         }
-
-        if (handle_internal_commands(args)) {
+        command_count++;
+        // Builtins that launch processes (parallel) apply the prefix options too
+        launch_options = launch_options_set(&cmd.options) ? &cmd.options : NULL;
+
+        if (cmd.timed && is_internal_command(cmd.stages[0][0])) {
+            // Builtins have no job: time them here, children they waited for included
+            struct rusage before, after;
+            struct timespec builtin_start;
+            getrusage(RUSAGE_CHILDREN, &before);
+            clock_gettime(CLOCK_MONOTONIC, &builtin_start);
+            handle_internal_commands(cmd.stages[0]);
+            double wall = elapsed_seconds(&builtin_start);
+            getrusage(RUSAGE_CHILDREN, &after);
+            timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+            timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+            after.ru_nvcsw -= before.ru_nvcsw;
+            after.ru_nivcsw -= before.ru_nivcsw;
+            after.ru_minflt -= before.ru_minflt;
+            after.ru_majflt -= before.ru_majflt;
+            after.ru_maxrss = -1;   // A peak over every child ever reaped, and it cannot be subtracted
+            print_usage_report(stderr, wall, &after);
             continue;
         }
 
-        if (pipe_args[0] != NULL) { 
-            execute_pipe_command(args, pipe_args);
-        } else if (input_file || output_file || error_file) { 
-            execute_with_redirection(args, input_file, output_file, error_file, append_output, background);
-        } else { 
-            execute_command(args, background);
+        if (handle_internal_commands(cmd.stages[0])) {
+            continue;
         }
+
+        execute_parsed_command(&cmd);
     }
 
-    return 0;
-}
+    if (report_time) {
+        double total = elapsed_seconds(&start);
+        fprintf(stderr, "myshell: %lu commands in %.6f s (%.1f us/command)\n",
+                command_count, total, command_count ? total * 1e6 / command_count : 0.0);
+    }
 
+    arena_free(&command_arena);
+    reader_free(&shell_input);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#!/bin/sh
+# test_myshell.sh - behaviour checks for myshell
+#
+# Build:  gcc -O2 -Wall -o myshell project2.c
+# Run:    ./test_myshell.sh [./myshell]
+#
+# Every check runs myshell on a small script and compares what it prints with
+# the expected text. Exits non-zero if any check fails.
+
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+export MYSHELL_HISTFILE="$dir/history"
+failed=0
+
+# check name expected-output command...: stdout of the command, prompts removed
+check() {
+    name=$1
+    expected=$2
+    shift 2
+    actual=$("$@" 2>/dev/null | sed 's/myshell: //g' | grep -v '^$')
+    if [ "$actual" = "$expected" ]; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        echo "  expected: $expected"
+        echo "  actual:   $actual"
+        failed=1
+    fi
+}
+
+# parallel reading its items from stdin must leave the shell's own input alone
+printf 'parallel -k echo item {}\necho after\n' > "$dir/parallel.sh"
+check "parallel items from stdin, script file goes on" "item a
+item b
+after" sh -c 'printf "a\nb\n" | "$1" "$2"' sh "$shell" "$dir/parallel.sh"
+check "parallel items from stdin, script on stdin goes on" "after" sh -c '"$1" < "$2"' sh "$shell" "$dir/parallel.sh"
+
+exit $failed
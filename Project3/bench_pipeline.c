@@ -0,0 +1,326 @@
+// bench_pipeline - end-to-end throughput and latency of project3 on synthetic input
+//
+// Build:  gcc -O2 -Wall -o bench_pipeline bench_pipeline.c -lm   (needs project3 built beside it)
+// Run:    ./bench_pipeline [-p ./project3] [-m megabytes] [-l lengths,...] [-r repeats] [-f csv|json] [-o file]
+//
+// Generates a text file of the given size for every line-length distribution
+// and runs project3 on a fresh copy of it in each mode (pool, dedicated
+// threads, streaming, mmap, pool over io_uring), with -M for its metrics report. Distributions:
+//   fixed:N        every line N bytes
+//   uniform:A-B    lengths uniform in [A, B]
+//   exp:MEAN       exponential with the given mean, so mostly short lines and a long tail
+//   bimodal:A:B:P  A bytes, or B bytes with probability P percent
+// Every result is one row: benchmark, mode, param, metric, value, unit; the
+// best of the repeats is kept.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <errno.h>
+
+#define MAX_RESULTS 512
+
+typedef struct {
+    char benchmark[32];
+    char mode[16];
+    char param[48];
+    char metric[16];
+    double value;
+    const char *unit;
+} Result;
+
+typedef struct {
+    const char *name;
+    const char *args[8];        // Extra project3 arguments
+} Mode;
+
+Result results[MAX_RESULTS];
+int result_count = 0;
+
+char *program_path = "./project3";
+char temp_dir[] = "/tmp/bench_pipeline.XXXXXX";
+char original_path[256];
+char input_path[256];
+char metrics_path[256];
+
+Mode modes[] = {
+    { "pool", { NULL } },
+    { "threads", { "-n", "1", "2", "2", "1", NULL } },
+    { "stream", { "-s", NULL } },
+    { "mmap", { "-m", NULL } },
+    { "uring", { "-u", NULL } },
+};
+
+void add_result(const char *benchmark, const char *mode, const char *param, const char *metric, double value, const char *unit) {
+    if (result_count == MAX_RESULTS) {
+        return;
+    }
+    Result *r = &results[result_count++];
+    snprintf(r->benchmark, sizeof(r->benchmark), "%s", benchmark);
+    snprintf(r->mode, sizeof(r->mode), "%s", mode);
+    snprintf(r->param, sizeof(r->param), "%s", param);
+    snprintf(r->metric, sizeof(r->metric), "%s", metric);
+    r->value = value;
+    r->unit = unit;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Next line length for a distribution spec, or -1 if the spec is malformed
+long next_length(const char *spec) {
+    long a, b, p;
+    double mean;
+    if (sscanf(spec, "fixed:%ld", &a) == 1 && a >= 0) {
+        return a;
+    }
+    if (sscanf(spec, "uniform:%ld-%ld", &a, &b) == 2 && a >= 0 && b >= a) {
+        return a + rand() % (b - a + 1);
+    }
+    if (sscanf(spec, "exp:%lf", &mean) == 1 && mean > 0) {
+        return (long)(-mean * log(1.0 - rand() / (RAND_MAX + 1.0)));
+    }
+    if (sscanf(spec, "bimodal:%ld:%ld:%ld", &a, &b, &p) == 3 && a >= 0 && b >= 0) {
+        return rand() % 100 < p ? b : a;
+    }
+    return -1;
+}
+
+// Write about megabytes of lines with lengths from spec. Returns the line count, or -1.
+long generate(const char *spec, long megabytes) {
+    if (next_length(spec) < 0) {
+        fprintf(stderr, "Unknown line length distribution \"%s\"\n", spec);
+        return -1;
+    }
+    FILE *file = fopen(original_path, "w");
+    if (!file) {
+        perror(original_path);
+        return -1;
+    }
+    // Lower-case words and spaces, so both default stages have work to do
+    const char words[] = "the quick brown fox jumps over the lazy dog and keeps running ";
+    srand(1);
+    long size = megabytes << 20, written = 0, lines = 0;
+    while (written < size) {
+        long length = next_length(spec);
+        long offset = rand() % (sizeof(words) - 1);
+        for (long i = 0; i < length; i++) {
+            putc(words[(offset + i) % (sizeof(words) - 1)], file);
+        }
+        putc('\n', file);
+        written += length + 1;
+        lines++;
+    }
+    if (fclose(file) != 0) {
+        perror(original_path);
+        return -1;
+    }
+    return lines;
+}
+
+// project3 rewrites its input, so every run starts from a copy
+int copy_input(void) {
+    int in = open(original_path, O_RDONLY);
+    int out = open(input_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0) {
+        perror("copy input");
+        return -1;
+    }
+    char buffer[1 << 16];
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, n) != n) {
+            perror(input_path);
+            n = -1;
+            break;
+        }
+    }
+    close(in);
+    close(out);
+    return n < 0 ? -1 : 0;
+}
+
+// Run project3 on the input. Returns the wall time in seconds, or -1.
+double run_program(Mode *mode) {
+    char *argv[16] = { program_path, "-d", input_path, "-v", "off", "-M", metrics_path };
+    int argc = 7;
+    for (int i = 0; mode->args[i]; i++) {
+        argv[argc++] = (char *)mode->args[i];
+    }
+    argv[argc] = NULL;
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(program_path, argv);
+        perror(program_path);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s exited abnormally in mode %s\n", program_path, mode->name);
+        return -1;
+    }
+    return now() - start;
+}
+
+// Value after key in the first line of the metrics report
+double metrics_number(const char *key) {
+    FILE *file = fopen(metrics_path, "r");
+    if (!file) {
+        return 0;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    double value = 0;
+    if (getline(&line, &size, file) > 0) {
+        const char *p = strstr(line, key);
+        value = p ? strtod(p + strlen(key), NULL) : 0;
+    }
+    free(line);
+    fclose(file);
+    return value;
+}
+
+void bench_distribution(const char *spec, long megabytes, int repeats) {
+    long lines = generate(spec, megabytes);
+    if (lines < 0) {
+        return;
+    }
+    char param[48];
+    snprintf(param, sizeof(param), "%s,mb=%ld", spec, megabytes);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        double best = 0, p50 = 0, p99 = 0, work = 0;
+        for (int r = 0; r < repeats; r++) {
+            if (copy_input() != 0) {
+                return;
+            }
+            double wall = run_program(&modes[m]);
+            if (wall < 0) {
+                break;
+            }
+            if (best == 0 || wall < best) {
+                best = wall;
+                work = metrics_number("\"elapsed_s\":");
+                p50 = metrics_number("\"p50\":");
+                p99 = metrics_number("\"p99\":");
+            }
+        }
+        if (best == 0) {
+            continue;
+        }
+        add_result("pipeline", modes[m].name, param, "wall", best, "s");
+        add_result("pipeline", modes[m].name, param, "throughput", megabytes / best, "MB/s");
+        add_result("pipeline", modes[m].name, param, "lines", lines / best, "lines/s");
+        // Without loading the file and renaming the result
+        add_result("pipeline", modes[m].name, param, "stages", work, "s");
+        if (strcmp(modes[m].name, "mmap") != 0) { // mmap has no per-line latency
+            add_result("pipeline", modes[m].name, param, "p50", p50, "us");
+            add_result("pipeline", modes[m].name, param, "p99", p99, "us");
+        }
+    }
+}
+
+void print_results(FILE *out, int json) {
+    if (json) {
+        fprintf(out, "[\n");
+        for (int i = 0; i < result_count; i++) {
+            Result *r = &results[i];
+            fprintf(out, "  {\"benchmark\":\"%s\",\"mode\":\"%s\",\"param\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}%s\n",
+                    r->benchmark, r->mode, r->param, r->metric, r->value, r->unit, i + 1 < result_count ? "," : "");
+        }
+        fprintf(out, "]\n");
+    } else {
+        fprintf(out, "benchmark,mode,param,metric,value,unit\n");
+        for (int i = 0; i < result_count; i++) {
+            Result *r = &results[i];
+            fprintf(out, "%s,%s,\"%s\",%s,%.3f,%s\n", r->benchmark, r->mode, r->param, r->metric, r->value, r->unit);
+        }
+    }
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-p project3] [-m megabytes] [-l lengths,...] [-r repeats] [-f csv|json] [-o file]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    long megabytes = 64;
+    char *lengths = "fixed:80,uniform:1-200,exp:60,bimodal:20:4000:2";
+    int repeats = 3;
+    int json = 0;
+    char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:l:r:f:o:")) != -1) {
+        switch (opt) {
+        case 'p': program_path = optarg; break;
+        case 'm': megabytes = atol(optarg); break;
+        case 'l': lengths = optarg; break;
+        case 'r': repeats = atoi(optarg); break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        case 'o': output = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (megabytes <= 0 || repeats <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (access(program_path, X_OK) != 0) {
+        perror(program_path);
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(temp_dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(original_path, sizeof(original_path), "%s/original", temp_dir);
+    snprintf(input_path, sizeof(input_path), "%s/input", temp_dir);
+    snprintf(metrics_path, sizeof(metrics_path), "%s/metrics.json", temp_dir);
+
+    char *list = strdup(lengths), *saveptr;
+    for (char *spec = strtok_r(list, ",", &saveptr); spec; spec = strtok_r(NULL, ",", &saveptr)) {
+        fprintf(stderr, "%s...\n", spec);
+        bench_distribution(spec, megabytes, repeats);
+    }
+    free(list);
+
+    FILE *out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        out = stdout;
+    }
+    print_results(out, json);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    unlink(original_path);
+    unlink(input_path);
+    unlink(metrics_path);
+    rmdir(temp_dir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+// bench_transform - throughput of the uppercase + space-replace kernels in transform.h
+//
+// Build:  gcc -O2 -Wall -o bench_transform bench_transform.c
+// Run:    ./bench_transform [-m megabytes] [-r repeats]
+//
+// Compares the two per-byte loops the upper and replace threads used to run
+// (toupper() pass, then a space pass) with the fused kernel in every variant the
+// CPU supports, once over the whole buffer and once line by line (20-120 byte
+// lines, like a text file), and checks that all of them produce the same bytes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "transform.h"
+
+typedef struct {
+    size_t offset;
+    size_t length;
+} Span;
+
+char *input_text;
+char *expected;
+char *output;
+size_t size;
+Span *spans;            // Line boundaries of the input
+size_t span_count;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The upper_thread and replace_thread loops before the shared kernel
+void original_loops(const char *in, char *out, size_t length) {
+    memcpy(out, in, length);
+    for (size_t i = 0; i < length; i++) {
+        out[i] = toupper((unsigned char)out[i]);
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (out[i] == ' ') {
+            out[i] = '_';
+        }
+    }
+}
+
+void fused(const char *in, char *out, size_t length) {
+    transform_bytes(in, out, length, TRANSFORM_UPPER | TRANSFORM_REPLACE);
+}
+
+// Best of repeats, in GB/s
+double measure(void (*fn)(const char *, char *, size_t), int per_line, int repeats) {
+    double best = 0;
+    for (int r = 0; r < repeats; r++) {
+        double start = now();
+        if (per_line) {
+            for (size_t i = 0; i < span_count; i++) {
+                fn(input_text + spans[i].offset, output + spans[i].offset, spans[i].length);
+            }
+        } else {
+            fn(input_text, output, size);
+        }
+        double rate = size / (now() - start) / 1e9;
+        if (rate > best) best = rate;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = 256;
+    int repeats = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            megabytes = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-m megabytes] [-r repeats]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (megabytes == 0 || repeats <= 0) {
+        fprintf(stderr, "Error: size and repeats must be positive.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Mixed-case words, digits and punctuation separated by spaces, in lines
+    size = megabytes << 20;
+    input_text = malloc(size);
+    expected = malloc(size);
+    output = malloc(size);
+    spans = malloc((size / 20 + 1) * sizeof(Span));
+    if (!input_text || !expected || !output || !spans) {
+        perror("Memory allocation failed");
+        return EXIT_FAILURE;
+    }
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.,;-";
+    srand(1);
+    size_t offset = 0;
+    while (offset < size) {
+        size_t length = 20 + rand() % 101;
+        if (length > size - offset) length = size - offset;
+        for (size_t i = 0; i < length; i++) {
+            int r = rand() % 8;
+            input_text[offset + i] = r == 0 ? ' ' : alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        input_text[offset + length - 1] = '\n';
+        spans[span_count].offset = offset;
+        spans[span_count].length = length - 1;
+        span_count++;
+        offset += length;
+    }
+    original_loops(input_text, expected, size);
+
+    printf("%-8s %-6s %8s\n", "variant", "mode", "GB/s");
+    for (int per_line = 0; per_line <= 1; per_line++) {
+        const char *mode = per_line ? "lines" : "buffer";
+        printf("%-8s %-6s %8.2f\n", "loops", mode, measure(original_loops, per_line, repeats));
+
+        const char *variants[] = { "scalar", "sse2", "avx2", "avx512" };
+        for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+            if (transform_select(variants[v]) != 0) {
+                continue; // Not supported here
+            }
+            memcpy(output, input_text, size); // Newlines are not rewritten per line
+            double rate = measure(fused, per_line, repeats);
+            if (memcmp(output, expected, size) != 0) {
+                fprintf(stderr, "Error: %s output differs from the original loops\n", variants[v]);
+                return EXIT_FAILURE;
+            }
+            printf("%-8s %-6s %8.2f\n", variants[v], mode, rate);
+        }
+    }
+
+    free(input_text);
+    free(expected);
+    free(output);
+    free(spans);
+    return 0;
+}
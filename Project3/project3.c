@@ -2,74 +2,539 @@
 //Damla Kundak 150121001
 //Alp Buyukkose 150121055
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <regex.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "transform.h"
+
+#define READ_CHUNK_SIZE 65536   // Bytes the line reader asks read() for at a time
+#define QUEUE_CAPACITY 64       // Lines a stage queue holds before producers block
+#define WINDOW_SIZE 4096        // Lines that may be read ahead of the oldest unwritten line
+#define OUTPUT_BUFFER_SIZE (1 << 20)    // Bytes gathered before one pwrite
+#define MMAP_CHUNK_SIZE (4 << 20)       // Bytes of the mapped file a worker takes at a time
+#define BATCH_LINES 256         // Lines per pool task
+#define POOL_MAX_BATCHES 64     // Batches read ahead of the oldest unwritten one
+#define MAX_STAGES 16           // Transform stages a -t list may name
+#define FILES_IN_FLIGHT 8       // Files the pool works on at once, unless -F says otherwise
+#define ARENA_CHUNK_SIZE (1 << 20)      // Bytes of lines allocated from malloc at a time
+#define URING_ENTRIES 64        // io_uring requests in flight at once
+#define URING_BUFFERS 32        // Registered buffers of OUTPUT_BUFFER_SIZE bytes
+#define URING_READ_AHEAD 2      // Chunks of OUTPUT_BUFFER_SIZE requested ahead of each line reader
+
+// Lines are not malloc'd one by one but carved out of chunks: the Line, then
+// its text, back to back, so a batch of lines is a few contiguous cache lines
+// instead of hundreds of scattered allocations. Each file's reader fills one
+// chunk at a time and starts every BATCH_LINES on a fresh cache line, so
+// workers handling neighbouring batches do not share one. A chunk counts the
+// lines still alive in it and is freed by whoever frees the last of them.
+typedef struct {
+    long live;                  // Lines not freed yet, plus 1 while the reader fills it
+    size_t used;
+    size_t capacity;
+    char data[] __attribute__((aligned(64)));
+} ArenaChunk;
+
+// One line of the file on its way through the stages
+typedef struct {
+    long index;                 // 0-based line number
+    char *text;                 // Line without its newline
+    size_t length;
+    long read_ns;               // When a read stage took it, for the latency metric
+    ArenaChunk *chunk;          // Where the line lives
+    int text_owned;             // A stage replaced the text with a malloc'd copy
+} Line;
+
+typedef struct UringRequest UringRequest;
+
+// Chunked line reader: read() fills a buffer that grows for long lines, so
+// there is no limit on line length or count
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t start;               // First unconsumed byte
+    size_t end;                 // End of valid data
+    int eof;
+    // io_uring: reads in flight ahead of the buffer, oldest first
+    int uring;
+    off_t offset;               // File offset of the next read to request
+    UringRequest *ahead[URING_READ_AHEAD];
+    int ahead_head;
+    int ahead_count;
+} LineReader;
+
+typedef struct Batch Batch;
+
+// One file being transformed. Its output goes to a hidden temp file in the same
+// directory, which replaces the original with a rename once every line is written.
+typedef struct {
+    char *path;
+    char *temp_path;
+    LineReader reader;
+    Line **lines;               // Whole file when it is loaded up front
+    long total_lines;
+    long next_read_line;        // Next line a read stage takes
+    int output_fd;              // The temp file
+    off_t output_offset;        // Where the next output goes
+    // Pool mode; the counters are protected by pool_mutex
+    long next_batch_index;      // Only touched by the file's read task
+    int batches_in_flight;
+    int read_parked;            // The read task waits for a batch to be written
+    int reader_done;            // Every line has been put in a batch
+    Batch *batch_window[POOL_MAX_BATCHES];  // Written batches waiting for their offset, under output_mutex
+    long next_offset_batch;
+    int writes_pending;         // io_uring writes not completed yet, under uring_mutex
+    ArenaChunk *arena;          // Chunk the reader is filling with lines
+} FileJob;
+
+FileJob *input_file;            // The file the dedicated stage threads work on
+int streaming = 0;              // -s: read threads pull lines from the file as the pipeline drains
+
+// Files to process, in order: the -d paths, with directories replaced by the
+// regular files in them, then for "-d -" the paths read from stdin
+char **source_paths = NULL;
+int source_count = 0;
+int source_next_path = 0;
+int source_stdin = 0;
+pthread_mutex_t source_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Bounded multi-producer multi-consumer queue of lines between two stages.
+// Each line is popped by exactly one worker of the next stage; idle workers sleep
+// on the condition variables instead of polling the line array.
+typedef struct {
+    Line *items[QUEUE_CAPACITY];    // Ring buffer of lines
+    int head;                   // Next item to pop
+    int count;                  // Number of lines in the ring
+    int producers;              // Threads still pushing; the queue is finished when this reaches 0
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} LineQueue;
+
+// Read -> each stage group in turn -> write. stage_queues[g] feeds group g and
+// the last queue feeds the writers.
+LineQueue *stage_queues;
+
+pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Ordered output. Writers finish lines in any order; each one is parked in the
+// reorder window at index % WINDOW_SIZE, and whoever parks the next line in file
+// order copies every consecutive ready line into the current output buffer. A
+// full buffer is written with one pwrite at the offset reserved for it, outside
+// the lock, so several writers can have buffers in flight at once.
+Line *window[WINDOW_SIZE];      // Finished lines waiting for their predecessors
+long next_output_line = 0;      // Next line in file order to go into the buffer
+char *output_buffer = NULL;     // Lines gathered for the next pwrite
+size_t output_length = 0;
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the window and the buffer
+pthread_cond_t window_cond = PTHREAD_COND_INITIALIZER;    // Signaled when next_output_line moves
+
+// Transform stages. Each name -t accepts is described once in stage_registry:
+// byte-wise stages give the replacement of every byte, other stages rewrite the
+// whole line and may change its length. The -t list is split into groups, each
+// of which is one hop of the pipeline: a run of adjacent byte-wise stages is
+// composed into a single 256-entry table (or handed to the vector kernel in
+// transform.h when the table is one it implements), and every other stage is
+// a group of its own.
+typedef struct {
+    const char *name;
+    const char *help;
+    int (*map)(int c);                  // Byte-wise stages: what c becomes
+    size_t (*apply)(char **text, size_t length, void *arg); // Line stages: rewrite *text (NUL-terminated) in
+                                        // place, or point it at a new malloc'd buffer, and return the new
+                                        // length. The old text stays the caller's.
+    void *(*setup)(const char *arg);    // Stages that take "name=arg"; NULL if the argument is invalid
+} TransformStage;
 
-#define MAX_LINES 1000          // Maximum number of lines that can be read from the file
-#define MAX_LINE_LENGTH 1024    // Maximum length of each line
+typedef struct {
+    const TransformStage *stage;
+    void *arg;                          // From setup
+    char label[16];                     // Capitalized name, for the log
+    unsigned char table[256];           // Byte-wise stages
+} StageStep;
 
-// Arrays to track the status of each line for different operations
-int upper_done[MAX_LINES];      // Tracks if the line has been converted to uppercase
-int replace_done[MAX_LINES];    // Tracks if spaces in the line have been replaced with underscores
-char *lines[MAX_LINES];         // Array to store the lines read from the file
-int line_status[MAX_LINES];     // Status of each line: 0 (not read), 1 (read), 2 (uppercased), 3 (replaced), 4 (written)
-int total_lines = 0;            // Total number of lines read from the file
+typedef struct {
+    int first;                          // Steps first .. first + count - 1
+    int count;
+    int bytewise;
+    int flags;                          // transform_bytes() flags equivalent to table, or -1
+    unsigned char table[256];           // Composition of the steps' tables
+    char name[128];                     // "upper+replace", for the pool report
+} StageGroup;
 
-// Mutexes for each line to ensure thread safety
-pthread_mutex_t line_mutex[MAX_LINES];  
-pthread_mutex_t processed_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for the global processed line counter
-int processed_lines = 0;        // Counter for the number of lines processed
-pthread_cond_t cond_done = PTHREAD_COND_INITIALIZER;  // Condition variable to signal when all operations are done
+StageStep stage_steps[MAX_STAGES];
+int step_count = 0;
+StageGroup stage_groups[MAX_STAGES];
+int group_count = 0;
 
-unsigned int seed;              // Seed for random number generation
+typedef int Stage;              // STAGE_READ, then 1 + g for stage group g, then STAGE_WRITE
+
+#define STAGE_READ 0
+#define STAGE_WRITE (group_count + 1)
+#define STAGE_SLOTS (MAX_STAGES + 2)
+#define STAGE_IDLE STAGE_SLOTS  // Pool workers between tasks, in the metrics
+
+// Metrics (-M, -I). Every thread counts into its own ThreadMetrics, under the
+// stage it is working for, and the sampler and the report at exit add them
+// up. Lock and condition waits are only timed when they actually block.
+#define LATENCY_BUCKETS 48      // Bucket b holds latencies below 2^(b+1) ns
+
+typedef enum {
+    WAIT_READ_LOCK,             // read_mutex: one reader at a time
+    WAIT_OUTPUT_LOCK,           // output_mutex: the reorder window and offsets
+    WAIT_QUEUE_LOCK,            // A stage queue's mutex
+    WAIT_POOL_LOCK,             // pool_mutex and the task deques
+    WAIT_INPUT,                 // Idle: the input queue is empty, or the pool has no task
+    WAIT_OUTPUT,                // Blocked: the next queue is full
+    WAIT_WINDOW,                // Blocked: the line is too far ahead of the writers
+    WAIT_IO_LOCK,               // uring_mutex: submissions and buffers
+    WAIT_IO,                    // Blocked: a read has not completed, or the ring is full
+    WAIT_KINDS
+} WaitKind;
+
+const char *wait_names[WAIT_KINDS] = {
+    "read_lock", "output_lock", "queue_lock", "pool_lock", "idle", "queue_full", "window_full", "io_lock", "io"
+};
+
+typedef struct {
+    long lines[STAGE_SLOTS + 1];
+    long bytes[STAGE_SLOTS + 1];        // Line bytes going into the stage
+    long busy_ns[STAGE_SLOTS + 1];
+    long wait_ns[STAGE_SLOTS + 1][WAIT_KINDS];
+    long waits[STAGE_SLOTS + 1][WAIT_KINDS];
+    long latency[LATENCY_BUCKETS];      // From read to written, per line
+    long latency_ns;                    // Sum, for the mean
+    long latency_max_ns;
+} ThreadMetrics;
+
+int metrics_enabled = 0;
+const char *metrics_path = NULL;        // -M: JSON report at exit, "-" for stdout
+double sample_interval = 0;             // -I: seconds between samples on stderr
+__thread Stage current_stage = STAGE_READ;  // What this thread is working on
+
+// Tracing. Workers never print: each thread appends fixed-size records to its
+// own single-producer ring, and with per-line verbosity a logger thread drains
+// the rings and formats the records in the original "Upper_1 Upper_1 read
+// index ..." form. A record keeps the first TRACE_TEXT bytes of the line's text
+// before the operation; the converted text is recomputed when formatting.
+#define TRACE_RING_SIZE 4096    // Records per thread, a power of two
+#define TRACE_TEXT 100          // Bytes of line text kept in a record
+
+typedef enum {
+    VERBOSITY_OFF,              // Nothing
+    VERBOSITY_SUMMARY,          // Lines handled per thread and the pool report, at exit
+    VERBOSITY_LINE              // Every operation on every line
+} Verbosity;
+
+typedef enum {
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_CHUNK,                // -m: line is the start offset, length the chunk size
+    TRACE_GROUP,                // TRACE_GROUP + g: stage group g rewrote the line
+    TRACE_OPS = TRACE_GROUP + MAX_STAGES
+} TraceOp;
+
+typedef struct {
+    uint64_t time;              // Nanoseconds since the run started
+    long line;
+    uint32_t length;            // Full length of the text
+    uint16_t thread;
+    uint8_t op;
+    char text[TRACE_TEXT];
+} TraceRecord;
+
+typedef struct {
+    TraceRecord *records;       // Only allocated for per-line verbosity
+    long counts[TRACE_OPS][64]; // Lines handled per operation and thread id (capped)
+    unsigned long head __attribute__((aligned(64)));  // Written by the owning thread
+    unsigned long tail __attribute__((aligned(64)));  // Written by the logger
+} TraceRing;
+
+Verbosity verbosity = VERBOSITY_OFF;    // Plain runs print only what the baseline did
+
+// io_uring backend (-u). One ring is shared by every thread: a request is put
+// in the submission queue under uring_mutex and submitted right away, and
+// uring_thread reaps the completions. A write hands its buffer to the ring and
+// returns; the buffer is released when the write completes, and file_commit
+// waits for the file's writes before the fsync. Reads are requested
+// URING_READ_AHEAD chunks ahead of each line reader. Buffers come from a pool
+// registered with the kernel while one is free, so it does not have to map
+// them for every request, and from malloc otherwise. Without -u, or when the
+// kernel refuses the ring, the reader uses read() and the writers pwrite().
+struct UringRequest {
+    int op;                     // IORING_OP_*
+    int fd;
+    char *buffer;
+    size_t length;
+    off_t offset;
+    FileJob *file;              // Writes: the file whose writes_pending it counts in
+    int result;                 // Bytes transferred or -errno, once done
+    int done;
+    size_t consumed;            // Reads: bytes copied to the line reader so far
+};
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} Uring;
+
+int uring_active = 0;           // -u and the kernel accepted the ring
+Uring uring;
+pthread_t uring_completer;
+char *uring_buffers = NULL;     // URING_BUFFERS registered buffers, NULL if registering failed
+int uring_free_slots[URING_BUFFERS];
+int uring_free_count = 0;
+int uring_in_flight = 0;
+pthread_mutex_t uring_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t uring_cond = PTHREAD_COND_INITIALIZER;   // Signaled when a request completes
 
 // Function prototypes for thread functions
 void *read_thread(void *arg);
-void *upper_thread(void *arg);
-void *replace_thread(void *arg);
+void *transform_thread(void *arg);
 void *write_thread(void *arg);
-void read_file(const char *filename);
-char *remove_newline_copy(const char *line);
+void read_file(FileJob *file);
+int reader_open(LineReader *reader, const char *filename);
+char *reader_next(LineReader *reader, size_t *length);
+void reader_close(LineReader *reader);
+Line *line_create(FileJob *file, long index, const char *text, size_t length);
+void line_free(Line *line);
+void arena_release(ArenaChunk *chunk);
+void queue_init(LineQueue *queue, int producers);
+void queue_destroy(LineQueue *queue);
+void queue_push(LineQueue *queue, Line *line);
+Line *queue_pop(LineQueue *queue);
+void write_buffer(FileJob *file, char *buffer, size_t length, off_t offset);
+void trace(TraceOp op, int thread_id, long line, const char *text, size_t length);
+void trace_start(void);
+void trace_stop(void);
+long metric_clock(void);
+void metric_stage(Stage stage, long lines, long bytes, long busy_ns);
+void metric_latency(Line *line);
+void metered_lock(pthread_mutex_t *mutex, WaitKind kind);
+void metered_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, WaitKind kind);
+void metrics_start(void);
+void metrics_stop(const char *mode, int threads);
+double seconds_now(void);
+void queue_producer_done(LineQueue *queue);
+Line *take_line(FileJob *file);
+int run_mmap(const char *filename, int worker_count);
+int run_pool(int worker_count, int max_files, int load);
+void run_stage_threads(int read_count, int upper_count, int replace_count, int write_count);
+int available_cores(void);
+void source_add(const char *path);
+char *source_next(void);
+FileJob *file_open(const char *path, int load);
+int file_commit(FileJob *file);
+int parse_stages(const char *list);
+extern const TransformStage stage_registry[];
+void group_apply(StageGroup *group, Line *line);
+size_t step_apply(StageStep *step, char **text, size_t length);
+void group_map_bytes(StageGroup *group, const char *input, char *output, size_t length);
+int uring_start(void);
+void uring_stop(void);
+void uring_submit(UringRequest *request);
+void uring_wait(UringRequest *request);
+void uring_wait_writes(FileJob *file);
+void uring_discard(UringRequest *request);
+char *io_buffer_alloc(size_t size);
+void io_buffer_free(char *buffer);
+ssize_t reader_read(LineReader *reader, char *buffer, size_t size);
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s -d <file> [-d <file>...] [-s] [-m] [-t <stage,...>] [-v <level>] [-M <file>] [-I <seconds>] [-F <files>] [-u] [-n <read_threads> <upper_threads> <replace_threads> <write_threads>]\n", program);
+    fprintf(stderr, "  -d  a file to transform in place, a directory for every file in it, or - to read\n");
+    fprintf(stderr, "      paths from stdin, one per line; may be given several times\n");
+    fprintf(stderr, "  -F  files the pool works on at once (default %d); -n and -m take them one by one\n", FILES_IN_FLIGHT);
+    fprintf(stderr, "  -n  dedicate the given number of threads to each stage; without it batches of lines\n");
+    fprintf(stderr, "      go through a work-stealing pool with one worker per core\n");
+    fprintf(stderr, "  -s  stream the file through the stages in constant memory instead of loading it first\n");
+    fprintf(stderr, "  -m  map the file and transform newline-aligned chunks in parallel, one worker per core\n");
+    fprintf(stderr, "      (with -n, upper_threads + replace_threads workers)\n");
+    fprintf(stderr, "  -u  read and write through io_uring with registered buffers, if the kernel allows it\n");
+    fprintf(stderr, "  -v  off (default), summary: per-thread counts and the pool report, or line: log every operation on every line\n");
+    fprintf(stderr, "  -M  write per-stage throughput, latency and wait times as JSON to a file (- for stdout)\n");
+    fprintf(stderr, "  -I  print throughput and latency to stderr every given number of seconds\n");
+    fprintf(stderr, "  -t  transform stages to apply in order (default upper,replace); with -n the first\n");
+    fprintf(stderr, "      group of stages gets upper_threads and the others replace_threads each\n");
+    for (int i = 0; stage_registry[i].name; i++) {
+        fprintf(stderr, "      %-12s %s\n", stage_registry[i].name, stage_registry[i].help);
+    }
+}
 
 int main(int argc, char *argv[]) {
-    // Check command line arguments for correct usage
-    if (argc < 7 || strcmp(argv[1], "-d") != 0 || strcmp(argv[3], "-n") != 0) {
-        fprintf(stderr, "Usage: %s -d <file> -n <read_threads> <upper_threads> <replace_threads> <write_threads>\n", argv[0]);
+    // Parse command line arguments
+    int file_args = 0; // -d options given
+    int single_file = 1; // Exactly one -d, naming a file
+    int max_files = FILES_IN_FLIGHT; // -F
+    int read_count = 0; // Number of read threads
+    int upper_count = 0; // Number of upper case threads
+    int replace_count = 0; // Number of replace threads
+    int write_count = 0; // Number of write threads
+    int mapped = 0; // -m: chunk-parallel transform of the mapped file
+    int dedicated = 0; // -n given: one thread pool per stage instead of the shared pool
+    int use_uring = 0; // -u
+    const char *stages = "upper,replace"; // -t
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            int before = source_count;
+            source_add(argv[++i]);
+            single_file = ++file_args == 1 && source_count == before + 1 && !source_stdin &&
+                          strcmp(source_paths[before], argv[i]) == 0;
+        } else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+            max_files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 4 < argc) {
+            read_count = atoi(argv[++i]);
+            upper_count = atoi(argv[++i]);
+            replace_count = atoi(argv[++i]);
+            write_count = atoi(argv[++i]);
+            dedicated = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            streaming = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mapped = 1;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            use_uring = 1;
+        } else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            sample_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            stages = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "off") == 0) {
+                verbosity = VERBOSITY_OFF;
+            } else if (strcmp(argv[i], "summary") == 0) {
+                verbosity = VERBOSITY_SUMMARY;
+            } else if (strcmp(argv[i], "line") == 0) {
+                verbosity = VERBOSITY_LINE;
+            } else {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (file_args == 0 || max_files <= 0) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    // Parse command line arguments
-    char *filename = argv[2]; // File to read
-    int read_count = atoi(argv[4]); // Number of read threads
-    int upper_count = atoi(argv[5]); // Number of upper case threads
-    int replace_count = atoi(argv[6]); // Number of replace threads
-    int write_count = atoi(argv[7]); // Number of write threads
+    transform_select(NULL); // Pick the widest vector kernel once, before the threads start
+    if (parse_stages(stages) != 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
 
     // Validate thread counts
-    if (read_count <= 0 || upper_count <= 0 || replace_count <= 0 || write_count <= 0) {
+    if (dedicated && (read_count <= 0 || upper_count <= 0 || replace_count <= 0 || write_count <= 0)) {
         fprintf(stderr, "Error: Thread counts must be positive integers.\n");
         return EXIT_FAILURE;
     }
 
-    // Read lines from the specified file
-    read_file(filename);
+    metrics_enabled = metrics_path || sample_interval > 0;
+    int failed = 0; // Files that could not be transformed
+    char *path;
+    if (mapped) {
+        int workers = dedicated ? upper_count + replace_count : available_cores();
+        trace_start();
+        metrics_start();
+        while ((path = source_next())) {
+            failed += run_mmap(path, workers) != 0;
+            free(path);
+        }
+        trace_stop();
+        metrics_stop("mmap", workers);
+        return failed ? EXIT_FAILURE : 0;
+    }
+
+    if (use_uring) {
+        uring_start(); // Falls back to read and pwrite if the kernel says no
+    }
+    trace_start();
+    metrics_start();
+    if (!dedicated) {
+        // Files overlap in the pool; only a lone file is loaded before the run
+        failed = run_pool(available_cores(), max_files, single_file && !streaming);
+    }
+    while (dedicated && (path = source_next())) {
+        // Load every line up front, or let the read threads pull them one by one
+        input_file = file_open(path, !streaming);
+        free(path);
+        if (!input_file) {
+            failed++;
+            continue;
+        }
+        next_output_line = 0;
+        output_length = 0;
+        output_buffer = io_buffer_alloc(OUTPUT_BUFFER_SIZE);
+        run_stage_threads(read_count, upper_count, replace_count, write_count);
+        // Write the last partial buffer; file_commit makes it durable before the rename
+        write_buffer(input_file, output_buffer, output_length, input_file->output_offset);
+        failed += file_commit(input_file) != 0;
+    }
+    trace_stop();
+    metrics_stop(dedicated ? "threads" : "pool", dedicated ? read_count + upper_count + replace_count + write_count : available_cores());
+    uring_stop();
+
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// A thread of one stage group in run_stage_threads
+typedef struct {
+    int id;                     // 1-based within the group
+    int group;
+} StageThread;
 
-    // Initialize mutexes and line statuses
-    for (int i = 0; i < total_lines; i++) {
-        pthread_mutex_init(&line_mutex[i], NULL);
-        line_status[i] = 0; // Set initial status to "not read"
+// Run the pipeline with a fixed number of threads dedicated to each stage. The
+// first group of transform stages gets upper_count threads and every later one
+// replace_count; a single group (the fused default) gets both.
+void run_stage_threads(int read_count, int upper_count, int replace_count, int write_count) {
+    int group_threads[group_count];
+    int transform_count = 0;
+    for (int g = 0; g < group_count; g++) {
+        group_threads[g] = group_count == 1 ? upper_count + replace_count : g == 0 ? upper_count : replace_count;
+        transform_count += group_threads[g];
     }
 
-    // Seed the random number generator
-    seed = time(NULL);
+    // Each queue is finished once every thread of the stage feeding it is done
+    stage_queues = malloc((group_count + 1) * sizeof(LineQueue));
+    queue_init(&stage_queues[0], read_count);
+    for (int g = 0; g < group_count; g++) {
+        queue_init(&stage_queues[g + 1], group_threads[g]);
+    }
 
     // Create arrays for thread IDs
-    pthread_t read_threads[read_count], upper_threads[upper_count], replace_threads[replace_count], write_threads[write_count];
-    int read_ids[read_count], upper_ids[upper_count], replace_ids[replace_count], write_ids[write_count];
+    pthread_t read_threads[read_count], transform_threads[transform_count], write_threads[write_count];
+    int read_ids[read_count], write_ids[write_count];
+    StageThread transform_ids[transform_count];
 
     // Create read threads
     for (int i = 0; i < read_count; i++) {
@@ -77,16 +542,13 @@ int main(int argc, char *argv[]) {
         pthread_create(&read_threads[i], NULL, read_thread, &read_ids[i]);
     }
 
-    // Create upper case threads
-    for (int i = 0; i < upper_count; i++) {
-        upper_ids[i] = i + 1; // Assign thread IDs
-        pthread_create(&upper_threads[i], NULL, upper_thread, &upper_ids[i]);
-    }
-
-    // Create replace threads
-    for (int i = 0; i < replace_count; i++) {
-        replace_ids[i] = i + 1; // Assign thread IDs
-        pthread_create(&replace_threads[i], NULL, replace_thread, &replace_ids[i]);
+    // Create the threads of every stage group
+    int t = 0;
+    for (int g = 0; g < group_count; g++) {
+        for (int i = 0; i < group_threads[g]; i++, t++) {
+            transform_ids[t] = (StageThread){ i + 1, g };
+            pthread_create(&transform_threads[t], NULL, transform_thread, &transform_ids[t]);
+        }
     }
 
     // Create write threads
@@ -100,14 +562,9 @@ int main(int argc, char *argv[]) {
         pthread_join(read_threads[i], NULL);
     }
 
-    // Wait for all upper case threads to finish
-    for (int i = 0; i < upper_count; i++) {
-        pthread_join(upper_threads[i], NULL);
-    }
-
-    // Wait for all replace threads to finish
-    for (int i = 0; i < replace_count; i++) {
-        pthread_join(replace_threads[i], NULL);
+    // Wait for all transform threads to finish
+    for (int i = 0; i < transform_count; i++) {
+        pthread_join(transform_threads[i], NULL);
     }
 
     // Wait for all write threads to finish
@@ -115,167 +572,2025 @@ int main(int argc, char *argv[]) {
         pthread_join(write_threads[i], NULL);
     }
 
+    // Clean up: destroy queues
+    for (int g = 0; g <= group_count; g++) {
+        queue_destroy(&stage_queues[g]);
+    }
+    free(stage_queues);
+}
+
+// Open the input file for the line reader. Returns -1 if it cannot be opened.
+int reader_open(LineReader *reader, const char *filename) {
+    reader->fd = open(filename, O_RDONLY); // Open the file for reading
+    if (reader->fd < 0) {
+        fprintf(stderr, "Error opening file %s: %s\n", filename, strerror(errno)); // Handle file open error
+        return -1;
+    }
+    reader->capacity = READ_CHUNK_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    // Reads at explicit offsets only make sense for regular files
+    struct stat st;
+    reader->uring = uring_active && fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode);
+    reader->offset = 0;
+    reader->ahead_head = 0;
+    reader->ahead_count = 0;
+    return 0;
+}
+
+// Return the next line without its newline, or NULL at the end of the file.
+// The text stays valid until the next call.
+char *reader_next(LineReader *reader, size_t *length) {
+    size_t scanned = reader->start;
+    while (1) {
+        char *newline = memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+        if (newline) {
+            char *line = reader->buffer + reader->start;
+            *length = newline - line;
+            reader->start = newline - reader->buffer + 1;
+            return line;
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // Last line without a newline
+            char *line = reader->buffer + reader->start;
+            *length = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, grow if it fills the buffer, read more
+        size_t pending = reader->end - reader->start;
+        memmove(reader->buffer, reader->buffer + reader->start, pending);
+        reader->start = 0;
+        reader->end = pending;
+        scanned = pending;
+        if (reader->capacity - reader->end < READ_CHUNK_SIZE / 2) {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+            if (!reader->buffer) {
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = reader_read(reader, reader->buffer + reader->end, reader->capacity - reader->end);
+        if (n < 0) {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        reader->end += n;
+    }
+}
+
+void reader_close(LineReader *reader) {
+    // Reads requested past the end of the file may still be in flight
+    while (reader->ahead_count > 0) {
+        uring_discard(reader->ahead[reader->ahead_head]);
+        reader->ahead_head = (reader->ahead_head + 1) % URING_READ_AHEAD;
+        reader->ahead_count--;
+    }
+    close(reader->fd);
+    free(reader->buffer);
+}
+
+// Copy a line out of the reader's buffer into the file's arena. Callers
+// serialize access per file.
+Line *line_create(FileJob *file, long index, const char *text, size_t length) {
+    size_t size = (sizeof(Line) + length + 1 + 15) & ~(size_t)15;  // Keep the next Line aligned
+    ArenaChunk *chunk = file->arena;
+    if (chunk && index % BATCH_LINES == 0) {
+        chunk->used = (chunk->used + 63) & ~(size_t)63; // A batch starts on its own cache line
+    }
+    if (!chunk || chunk->used + size > chunk->capacity) {
+        if (chunk) {
+            arena_release(chunk); // The reader is done with it
+        }
+        size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE; // A long line gets a chunk of its own
+        chunk = file->arena = aligned_alloc(64, (sizeof(ArenaChunk) + capacity + 63) & ~(size_t)63);
+        if (!chunk) {
+            perror("Memory allocation failed"); // Handle memory allocation error
+            exit(EXIT_FAILURE);
+        }
+        chunk->live = 1;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+    }
+    Line *line = (Line *)(chunk->data + chunk->used);
+    chunk->used += size;
+    __atomic_add_fetch(&chunk->live, 1, __ATOMIC_RELAXED);
+    line->text = (char *)(line + 1);
+    memcpy(line->text, text, length);
+    line->text[length] = '\0';
+    line->length = length;
+    line->index = index;
+    line->chunk = chunk;
+    line->text_owned = 0;
+    return line;
+}
+
+// Drop one reference to a chunk, freeing it with the last one
+void arena_release(ArenaChunk *chunk) {
+    if (__atomic_sub_fetch(&chunk->live, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(chunk);
+    }
+}
+
+void line_free(Line *line) {
+    if (line->text_owned) {
+        free(line->text);
+    }
+    arena_release(line->chunk);
+}
+
+// Function to read all lines of the file before the threads start
+void read_file(FileJob *file) {
+    char *text;
+    size_t length;
+    long capacity = 0;
+    while ((text = reader_next(&file->reader, &length))) { // Read each line
+        if (file->total_lines == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            file->lines = realloc(file->lines, capacity * sizeof(Line *));
+        }
+        file->lines[file->total_lines] = line_create(file, file->total_lines, text, length); // Copy the line and store it
+        file->total_lines++;
+    }
+}
+
+// Create a hidden temp file next to path with the given permissions, so the
+// output can replace path with an atomic rename. Returns the descriptor or -1.
+int temp_create(const char *path, mode_t mode, char **temp_path) {
+    const char *slash = strrchr(path, '/');
+    int directory_length = slash ? (int)(slash - path + 1) : 0;
+    *temp_path = malloc(strlen(path) + 16);
+    sprintf(*temp_path, "%.*s.%s.XXXXXX", directory_length, path, path + directory_length);
+    int fd = mkstemp(*temp_path);
+    if (fd < 0 || fchmod(fd, mode & 07777) != 0) {
+        fprintf(stderr, "Error creating output file for %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(*temp_path);
+        }
+        free(*temp_path);
+        return -1;
+    }
+    return fd;
+}
+
+// Open path for transforming, loading all of its lines if load is set.
+// Returns NULL after printing the error if it cannot be opened.
+FileJob *file_open(const char *path, int load) {
+    FileJob *file = calloc(1, sizeof(FileJob));
+    struct stat st;
+    if (reader_open(&file->reader, path) != 0) {
+        free(file);
+        return NULL;
+    }
+    if (fstat(file->reader.fd, &st) != 0 ||
+        (file->output_fd = temp_create(path, st.st_mode, &file->temp_path)) < 0) {
+        reader_close(&file->reader);
+        free(file);
+        return NULL;
+    }
+    file->path = strdup(path);
+    if (load) {
+        read_file(file);
+    }
+    return file;
+}
+
+// Make the finished output durable, rename it over the original and free the
+// file. Returns -1 after printing the error if the original was not replaced.
+int file_commit(FileJob *file) {
+    int status = 0;
+    uring_wait_writes(file);
+    if (fsync(file->output_fd) != 0) {
+        perror("Error syncing output file");
+        status = -1;
+    }
+    close(file->output_fd);
     // Rename the output file to match the input file name
-    if (rename("temp_output.txt", filename) != 0) {
+    if (status == 0 && rename(file->temp_path, file->path) != 0) {
         perror("Error renaming output file");
-        return EXIT_FAILURE;
+        status = -1;
+    }
+    if (status != 0) {
+        unlink(file->temp_path);
+    }
+    reader_close(&file->reader);
+    if (file->arena) {
+        arena_release(file->arena); // The writers have freed every line by now
+    }
+    free(file->lines); // The lines themselves are freed by the writers
+    free(file->temp_path);
+    free(file->path);
+    free(file);
+    return status;
+}
+
+// Add a -d argument to the files to process
+void source_add(const char *path) {
+    struct stat st;
+    if (strcmp(path, "-") == 0) {
+        source_stdin = 1;
+        return;
+    }
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        // Errors are reported when the file is opened
+        source_paths = realloc(source_paths, (source_count + 1) * sizeof(char *));
+        source_paths[source_count++] = strdup(path);
+        return;
+    }
+    // Listed now, so the temp files created in the directory later are not picked up
+    struct dirent **entries;
+    int count = scandir(path, &entries, NULL, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "Error reading directory %s: %s\n", path, strerror(errno));
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        char *full = malloc(strlen(path) + strlen(entries[i]->d_name) + 2);
+        sprintf(full, "%s/%s", path, entries[i]->d_name);
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+            source_paths = realloc(source_paths, (source_count + 1) * sizeof(char *));
+            source_paths[source_count++] = full;
+        } else {
+            free(full);
+        }
+        free(entries[i]);
     }
+    free(entries);
+}
 
-    // Clean up: destroy mutexes and free allocated memory
-    for (int i = 0; i < total_lines; i++) {
-        pthread_mutex_destroy(&line_mutex[i]);
-        if (lines[i]) free(lines[i]); // Free each line
+// Next file to process, or NULL when there are none left. The caller frees it.
+char *source_next(void) {
+    char *path = NULL;
+    pthread_mutex_lock(&source_mutex);
+    if (source_next_path < source_count) {
+        path = source_paths[source_next_path];
+        source_paths[source_next_path++] = NULL;
+    }
+    while (!path && source_stdin) {
+        size_t size = 0;
+        ssize_t length = getline(&path, &size, stdin);
+        if (length < 0) {
+            free(path);
+            path = NULL;
+            source_stdin = 0;
+        } else if (length > 0 && path[length - 1] == '\n') {
+            path[length - 1] = '\0';
+        }
+        if (path && path[0] == '\0') {
+            free(path); // Skip blank lines
+            path = NULL;
+        }
     }
+    pthread_mutex_unlock(&source_mutex);
+    return path;
+}
 
-    return 0; 
+// Initialize an empty queue fed by the given number of producer threads
+void queue_init(LineQueue *queue, int producers) {
+    queue->head = 0;
+    queue->count = 0;
+    queue->producers = producers;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
 }
 
-// Function to read lines from a file
-void read_file(const char *filename) {
-    FILE *file = fopen(filename, "r"); // Open the file for reading
-    if (!file) {
-        perror("Error opening file"); // Handle file open error
-        exit(EXIT_FAILURE);
+void queue_destroy(LineQueue *queue) {
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+// Append a line, blocking while the queue is full
+void queue_push(LineQueue *queue, Line *line) {
+    metered_lock(&queue->mutex, WAIT_QUEUE_LOCK);
+    while (queue->count == QUEUE_CAPACITY) {
+        metered_wait(&queue->not_full, &queue->mutex, WAIT_OUTPUT);
+    }
+    queue->items[(queue->head + queue->count) % QUEUE_CAPACITY] = line;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty); // Wake one waiting consumer
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Take the oldest line, blocking while the queue is empty.
+// Returns NULL once the queue is empty and all producers are done.
+Line *queue_pop(LineQueue *queue) {
+    metered_lock(&queue->mutex, WAIT_QUEUE_LOCK);
+    while (queue->count == 0 && queue->producers > 0) {
+        metered_wait(&queue->not_empty, &queue->mutex, WAIT_INPUT);
     }
+    Line *line = NULL;
+    if (queue->count > 0) {
+        line = queue->items[queue->head];
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full); // Wake one waiting producer
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return line;
+}
 
-    char buffer[MAX_LINE_LENGTH]; // Buffer to hold each line
-    while (fgets(buffer, sizeof(buffer), file)) { // Read each line
-        lines[total_lines] = strdup(buffer); // Duplicate the line and store it
-        total_lines++; 
+// Called by each producer thread when it has pushed its last line
+void queue_producer_done(LineQueue *queue) {
+    metered_lock(&queue->mutex, WAIT_QUEUE_LOCK);
+    queue->producers--;
+    if (queue->producers == 0) {
+        pthread_cond_broadcast(&queue->not_empty); // Let every consumer see the end
     }
-    fclose(file); 
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Take the next line for a read thread: from the loaded file, or straight from
+// the reader when streaming. Returns NULL when there are no lines left.
+Line *next_line(void) {
+    Line *line = NULL;
+    metered_lock(&read_mutex, WAIT_READ_LOCK);
+
+    // A line may only enter the pipeline once its slot in the reorder window is free
+    metered_lock(&output_mutex, WAIT_OUTPUT_LOCK);
+    while (input_file->next_read_line - next_output_line >= WINDOW_SIZE) {
+        metered_wait(&window_cond, &output_mutex, WAIT_WINDOW);
+    }
+    pthread_mutex_unlock(&output_mutex);
+    long start = metric_clock();
+    line = take_line(input_file);
+    if (line) {
+        metric_stage(STAGE_READ, 1, line->length, line->read_ns - start);
+    }
+    pthread_mutex_unlock(&read_mutex);
+    return line;
+}
+
+// Next line of the file, or NULL at the end. Callers serialize access.
+Line *take_line(FileJob *file) {
+    Line *line = NULL;
+    if (!file->lines) {
+        size_t length;
+        char *text = reader_next(&file->reader, &length);
+        line = text ? line_create(file, file->next_read_line++, text, length) : NULL;
+    } else if (file->next_read_line < file->total_lines) {
+        line = file->lines[file->next_read_line++];
+    }
+    if (line) {
+        line->read_ns = metric_clock();
+    }
+    return line;
 }
 
 // Function for the read thread
 void *read_thread(void *arg) {
     int thread_id = *(int *)arg; // Get the thread ID
-    for (int index = 0; index < total_lines; index++) {
-        pthread_mutex_lock(&line_mutex[index]); // Lock the mutex for the current line
-        if (line_status[index] == 0) { // Check if the line has not been read
-            // Print the line read by the thread
-            printf("Read_%d Read_%d read the line %d which is \"%s\"\n", thread_id, thread_id, index + 1, remove_newline_copy(lines[index]));
-            line_status[index] = 1;  // Mark the line as read
-        }
-        pthread_mutex_unlock(&line_mutex[index]); // Unlock the mutex
-        usleep(rand() % 1000);  // Simulate a delay
+    Line *line;
+    // Blocks in queue_push while the later stages are behind, which bounds memory when streaming
+    while ((line = next_line())) {
+        trace(TRACE_READ, thread_id, line->index, line->text, line->length);
+        queue_push(&stage_queues[0], line); // Hand the line to the first stage group
     }
+    queue_producer_done(&stage_queues[0]);
     return NULL; 
 } 
 
-// Function for the replace thread
-void *replace_thread(void *arg) {
-    int thread_id = *(int *)arg; // Get the thread ID
-    for (int index = 0; index < total_lines; index++) {
-        pthread_mutex_lock(&line_mutex[index]); // Lock the mutex for the current line
-        if ((line_status[index] == 1 || upper_done[index]) && !replace_done[index]) {  // Check if the line is ready for replacement
-            char *original_line = strdup(lines[index]); // Duplicate the original line
-            for (int i = 0; lines[index][i]; i++) { // Replace spaces with underscores
-                if (lines[index][i] == ' ') {
-                    lines[index][i] = '_';
-                }
-            }
-            // Print the replacement operation
-            printf("Replace_%d Replace_%d read index %d and converted \"%s\" to \"%s\"\n", thread_id, thread_id, index + 1, original_line, lines[index]);
-            free(original_line); // Free the original line
-            replace_done[index] = 1; // Mark the line as replaced
-            // Check if both upper and replace operations are done
-            if (upper_done[index]) {
-                line_status[index] = 3; // Mark the line as ready for writing
-            }
-        }
-        pthread_mutex_unlock(&line_mutex[index]); // Unlock the mutex
-        usleep(rand() % 1000);  // Simulate a delay
+// Function for the threads of a stage group
+void *transform_thread(void *arg) {
+    StageThread *thread = arg;
+    StageGroup *group = &stage_groups[thread->group];
+    current_stage = STAGE_READ + 1 + thread->group;
+    LineQueue *input = &stage_queues[thread->group];
+    LineQueue *output = &stage_queues[thread->group + 1];
+    Line *line;
+    // Only this thread owns the line between popping and pushing it, so no lock is needed
+    while ((line = queue_pop(input))) {
+        trace(TRACE_GROUP + thread->group, thread->id, line->index, line->text, line->length);
+        long start = metric_clock();
+        size_t length = line->length;
+        group_apply(group, line);
+        metric_stage(current_stage, 1, length, metric_clock() - start);
+        queue_push(output, line); // Hand the line to the next group or the writers
     }
+    queue_producer_done(output);
     return NULL;
 }
 
-// Function for the upper case thread
-void *upper_thread(void *arg) {
+// pwrite length bytes at offset in fd, however many calls it takes
+void pwrite_all(int fd, const char *buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, buffer + done, length - done, offset + done);
+        if (n < 0) {
+            perror("Error writing to file"); // Handle write error
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+}
+
+// Write a whole buffer at its offset in the file's output and free it. With
+// io_uring the write is only submitted here; see UringRequest.
+void write_buffer(FileJob *file, char *buffer, size_t length, off_t offset) {
+    if (uring_active && length > 0 && length <= (1 << 30)) { // sqe->len is 32 bits
+        UringRequest *request = calloc(1, sizeof(UringRequest));
+        request->op = IORING_OP_WRITE;
+        request->fd = file->output_fd;
+        request->buffer = buffer;
+        request->length = length;
+        request->offset = offset;
+        request->file = file;
+        uring_submit(request);
+        return;
+    }
+    pwrite_all(file->output_fd, buffer, length, offset);
+    io_buffer_free(buffer);
+}
+
+// Function for the write thread
+void *write_thread(void *arg) {
     int thread_id = *(int *)arg; // Retrieve the thread ID from the argument
-    // Loop through all lines
-    for (int index = 0; index < total_lines; index++) {
-        pthread_mutex_lock(&line_mutex[index]); // Lock the mutex for the current line
-        // Check if the line has been read and not yet converted to uppercase
-        if (line_status[index] == 1 && !upper_done[index]) {  
-            char *original_line = strdup(lines[index]); // Duplicate the original line for logging
-            // Convert each character in the line to uppercase
-            for (int i = 0; lines[index][i]; i++) {
-                lines[index][i] = toupper(lines[index][i]);
+    Line *line;
+    current_stage = STAGE_WRITE;
+    // Block until a line is ready; stops once the last stage group is finished
+    while ((line = queue_pop(&stage_queues[group_count]))) {
+        long start = metric_clock();
+        metered_lock(&output_mutex, WAIT_OUTPUT_LOCK);
+        window[line->index % WINDOW_SIZE] = line;
+        // Move every line that is now next in file order into the buffer
+        while ((line = window[next_output_line % WINDOW_SIZE]) && line->index == next_output_line) {
+            if (output_length + line->length + 1 > OUTPUT_BUFFER_SIZE && output_length > 0) {
+                // Hand the full buffer to this thread, start the next one after it
+                char *full_buffer = output_buffer;
+                size_t full_length = output_length;
+                off_t full_offset = input_file->output_offset;
+                input_file->output_offset += output_length;
+                output_length = 0;
+                output_buffer = io_buffer_alloc(OUTPUT_BUFFER_SIZE);
+                pthread_mutex_unlock(&output_mutex);
+                write_buffer(input_file, full_buffer, full_length, full_offset);
+                metered_lock(&output_mutex, WAIT_OUTPUT_LOCK);
+                continue; // Other writers may have moved lines meanwhile; look again
             }
-            // Print the conversion operation
-            printf("Upper_%d Upper_%d read index %d and converted \"%s\" to \"%s\"\n", 
-                   thread_id, thread_id, index + 1, original_line, lines[index]);
-            free(original_line); // Free the duplicated original line
-            upper_done[index] = 1; // Mark the line as converted to uppercase
-            // Check if the replace operation for this line is also done
-            if (replace_done[index]) {
-                line_status[index] = 3; // Mark the line as ready for writing
+            window[next_output_line % WINDOW_SIZE] = NULL;
+            if (line->length + 1 > OUTPUT_BUFFER_SIZE) {
+                // A line longer than a whole buffer is written on its own
+                char *single = malloc(line->length + 1);
+                memcpy(single, line->text, line->length);
+                single[line->length] = '\n';
+                write_buffer(input_file, single, line->length + 1, input_file->output_offset);
+                input_file->output_offset += line->length + 1;
+            } else {
+                // The newline was stripped when the line was read
+                memcpy(output_buffer + output_length, line->text, line->length);
+                output_buffer[output_length + line->length] = '\n';
+                output_length += line->length + 1;
             }
+            trace(TRACE_WRITE, thread_id, line->index, line->text, line->length);
+            metric_stage(STAGE_WRITE, 1, line->length + 1, 0);
+            metric_latency(line);
+            next_output_line++;
+            line_free(line); // Nothing refers to the line after it is copied out
         }
-        pthread_mutex_unlock(&line_mutex[index]); // Unlock the mutex for the current line
-        usleep(rand() % 1000);  // Simulate a delay to mimic processing time
+        pthread_cond_broadcast(&window_cond); // Read threads may be waiting for window space
+        pthread_mutex_unlock(&output_mutex);
+        metric_stage(STAGE_WRITE, 0, 0, metric_clock() - start);
     }
     return NULL; 
 }
 
-// Function for the write thread
-void *write_thread(void *arg) {
-    int thread_id = *(int *)arg; // Retrieve the thread ID from the argument
-    while (1) { // Infinite loop until all lines are processed
-        int processed = 0; // Flag to check if any line was processed
-        // Loop through all lines
-        for (int index = 0; index < total_lines; index++) {
-            pthread_mutex_lock(&line_mutex[index]); // Lock the mutex for the current line
-            // Check if the line is ready for writing (i.e., replace operation is done)
-            if (line_status[index] == 3) { 
-                FILE *file = fopen("temp_output.txt", "a"); // Open the output file for appending
-                if (!file) {
-                    perror("Error opening output file"); // Handle file open error
-                    pthread_mutex_unlock(&line_mutex[index]); // Unlock the mutex before exiting
-                    pthread_exit(NULL); // Exit the thread on error
+// Number of cores this process may run on
+int available_cores(void) {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        return CPU_COUNT(&cpus);
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+// Transform stages: see TransformStage
+int upper_byte(int c) {
+    return toupper(c);
+}
+
+int lower_byte(int c) {
+    return tolower(c);
+}
+
+int replace_byte(int c) {
+    return c == ' ' ? '_' : c;
+}
+
+// Move text[start, end) to the front of the line
+size_t keep_range(char *text, size_t start, size_t end) {
+    memmove(text, text + start, end - start);
+    text[end - start] = '\0';
+    return end - start;
+}
+
+size_t trim_line(char **text, size_t length, void *arg) {
+    (void)arg;
+    size_t start = 0;
+    while (start < length && isspace((unsigned char)(*text)[start])) {
+        start++;
+    }
+    while (length > start && isspace((unsigned char)(*text)[length - 1])) {
+        length--;
+    }
+    return keep_range(*text, start, length);
+}
+
+void *field_setup(const char *arg) {
+    long number = arg ? atol(arg) : 0;
+    return number > 0 ? (void *)number : NULL;
+}
+
+// Keep only the Nth field (from 1) of the blank-separated fields; empty if there are fewer
+size_t field_line(char **text, size_t length, void *arg) {
+    long wanted = (long)arg;
+    size_t i = 0;
+    for (long field = 1; ; field++) {
+        while (i < length && isblank((unsigned char)(*text)[i])) {
+            i++;
+        }
+        size_t start = i;
+        while (i < length && !isblank((unsigned char)(*text)[i])) {
+            i++;
+        }
+        if (field == wanted || start == length) {
+            return keep_range(*text, start, i);
+        }
+    }
+}
+
+typedef struct {
+    regex_t pattern;
+    const char *replacement;
+    size_t replacement_length;
+} Substitution;
+
+// "pattern/replacement", split at the last '/'; the pattern is an extended regex
+void *sub_setup(const char *arg) {
+    const char *slash = arg ? strrchr(arg, '/') : NULL;
+    if (!slash || slash == arg) {
+        return NULL;
+    }
+    Substitution *sub = malloc(sizeof(Substitution));
+    char *pattern = strndup(arg, slash - arg);
+    int error = regcomp(&sub->pattern, pattern, REG_EXTENDED);
+    free(pattern);
+    if (error != 0) {
+        free(sub);
+        return NULL;
+    }
+    sub->replacement = strdup(slash + 1); // The -t list is parsed from a temporary copy
+    sub->replacement_length = strlen(slash + 1);
+    return sub;
+}
+
+// Append count bytes to a growing buffer
+void text_append(char **buffer, size_t *length, size_t *capacity, const char *bytes, size_t count) {
+    if (*length + count + 1 > *capacity) {
+        *capacity = (*length + count + 1) * 2;
+        *buffer = realloc(*buffer, *capacity);
+        if (!*buffer) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buffer + *length, bytes, count);
+    *length += count;
+}
+
+// Replace every match of the pattern; the line is only copied if something matches
+size_t sub_line(char **text, size_t length, void *arg) {
+    Substitution *sub = arg;
+    char *result = NULL;
+    size_t result_length = 0, capacity = 0;
+    size_t position = 0;
+    size_t previous_end = (size_t)-1;
+    regmatch_t match;
+    while (position <= length &&
+           regexec(&sub->pattern, *text + position, 1, &match, position > 0 ? REG_NOTBOL : 0) == 0) {
+        size_t start = position + match.rm_so;
+        size_t end = position + match.rm_eo;
+        text_append(&result, &result_length, &capacity, *text + position, match.rm_so);
+        // Like sed, an empty match right after the previous match is not replaced
+        if (end > start || start != previous_end) {
+            text_append(&result, &result_length, &capacity, sub->replacement, sub->replacement_length);
+        }
+        position = end;
+        if (end == start) {
+            // Keep the next character and look again after it
+            if (position < length) {
+                text_append(&result, &result_length, &capacity, *text + position, 1);
+            }
+            position++;
+        }
+        previous_end = end;
+    }
+    if (!result) {
+        return length;
+    }
+    if (position < length) {
+        text_append(&result, &result_length, &capacity, *text + position, length - position);
+    }
+    result[result_length] = '\0';
+    *text = result;
+    return result_length;
+}
+
+const TransformStage stage_registry[] = {
+    { "upper", "a-z to A-Z", upper_byte, NULL, NULL },
+    { "lower", "A-Z to a-z", lower_byte, NULL, NULL },
+    { "replace", "spaces to underscores", replace_byte, NULL, NULL },
+    { "trim", "drop leading and trailing whitespace", NULL, trim_line, NULL },
+    { "field=N", "keep the Nth blank-separated field", NULL, field_line, field_setup },
+    { "sub=RE/TEXT", "replace every match of the extended regex RE with TEXT", NULL, sub_line, sub_setup },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+// Table of what transform_bytes() does to each byte with the given flags
+void kernel_table(int flags, unsigned char table[256]) {
+    for (int c = 0; c < 256; c++) {
+        char byte = (char)c;
+        transform_bytes(&byte, &byte, 1, flags);
+        table[c] = (unsigned char)byte;
+    }
+}
+
+// Fill stage_steps and stage_groups from a -t list such as "upper,replace,trim".
+// Returns -1 after printing the problem if a stage is unknown or malformed.
+int parse_stages(const char *list) {
+    char *copy = strdup(list);
+    char *saveptr;
+    step_count = 0;
+    for (char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        if (step_count == MAX_STAGES) {
+            fprintf(stderr, "Error: At most %d stages can be given.\n", MAX_STAGES);
+            free(copy);
+            return -1;
+        }
+        char *arg = strchr(item, '=');
+        size_t name_length = arg ? (size_t)(arg - item) : strlen(item);
+        const TransformStage *stage = NULL;
+        for (int i = 0; stage_registry[i].name && !stage; i++) {
+            const char *name = stage_registry[i].name;
+            if (strncmp(name, item, name_length) == 0 && (name[name_length] == '\0' || name[name_length] == '=') &&
+                !arg == !stage_registry[i].setup) {
+                stage = &stage_registry[i];
+            }
+        }
+        StageStep *step = &stage_steps[step_count];
+        step->stage = stage;
+        step->arg = stage && stage->setup ? stage->setup(arg + 1) : NULL;
+        if (!stage || (stage->setup && !step->arg)) {
+            fprintf(stderr, "Error: Unknown or malformed stage \"%s\".\n", item);
+            free(copy);
+            return -1;
+        }
+        snprintf(step->label, sizeof(step->label), "%.*s", (int)name_length, item);
+        step->label[0] = toupper((unsigned char)step->label[0]);
+        if (stage->map) {
+            for (int c = 0; c < 256; c++) {
+                step->table[c] = (unsigned char)stage->map(c);
+            }
+        }
+        step_count++;
+    }
+    free(copy);
+    if (step_count == 0) {
+        fprintf(stderr, "Error: No stages given.\n");
+        return -1;
+    }
+
+    // Group adjacent byte-wise stages and compose their tables
+    group_count = 0;
+    for (int i = 0; i < step_count; i++) {
+        StageStep *step = &stage_steps[i];
+        StageGroup *group = group_count > 0 ? &stage_groups[group_count - 1] : NULL;
+        if (!step->stage->map || !group || !group->bytewise) {
+            group = &stage_groups[group_count++];
+            group->first = i;
+            group->count = 0;
+            group->bytewise = step->stage->map != NULL;
+            group->name[0] = '\0';
+            for (int c = 0; c < 256; c++) {
+                group->table[c] = (unsigned char)c;
+            }
+        }
+        if (group->bytewise) {
+            for (int c = 0; c < 256; c++) {
+                group->table[c] = step->table[group->table[c]];
+            }
+        }
+        size_t used = strlen(group->name) + (group->count > 0);
+        snprintf(group->name + used - (group->count > 0), sizeof(group->name) - used, "%s%s",
+                 group->count > 0 ? "+" : "", step->label);
+        group->name[used] = tolower((unsigned char)group->name[used]);
+        group->count++;
+    }
+
+    // Let the vector kernel run any group it can do exactly
+    for (int g = 0; g < group_count; g++) {
+        StageGroup *group = &stage_groups[g];
+        group->flags = -1;
+        for (int flags = 0; group->bytewise && flags <= (TRANSFORM_UPPER | TRANSFORM_REPLACE) && group->flags < 0; flags++) {
+            unsigned char table[256];
+            kernel_table(flags, table);
+            if (memcmp(table, group->table, sizeof(table)) == 0) {
+                group->flags = flags;
+            }
+        }
+    }
+    return 0;
+}
+
+// Run one stage on a NUL-terminated malloc'd line; returns the new length
+size_t step_apply(StageStep *step, char **text, size_t length) {
+    if (!step->stage->map) {
+        return step->stage->apply(text, length, step->arg);
+    }
+    unsigned char *bytes = (unsigned char *)*text;
+    for (size_t i = 0; i < length; i++) {
+        bytes[i] = step->table[bytes[i]];
+    }
+    return length;
+}
+
+// Map length bytes through a byte-wise group; input and output may be the same
+void group_map_bytes(StageGroup *group, const char *input, char *output, size_t length) {
+    if (group->flags >= 0) {
+        transform_bytes(input, output, length, group->flags);
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        output[i] = (char)group->table[(unsigned char)input[i]];
+    }
+}
+
+// Run a whole group on a line in one pass; replaced text is freed unless it is in the arena
+void group_apply(StageGroup *group, Line *line) {
+    if (group->bytewise) {
+        group_map_bytes(group, line->text, line->text, line->length);
+        return;
+    }
+    char *text = line->text;
+    line->length = step_apply(&stage_steps[group->first], &line->text, line->length);
+    if (line->text != text) {
+        if (line->text_owned) {
+            free(text);
+        }
+        line->text_owned = 1;
+    }
+}
+
+// Work-stealing pool, the default when -n is not given. Lines move in batches
+// and a task is one (batch, stage) pair; finishing a stage pushes the batch's
+// next stage onto the worker's own deque. Owners pop the newest task so a batch
+// tends to stay on one core through all stages; idle workers steal the oldest
+// task from another deque, so whichever stage is behind gets every free core.
+// Each file has a single read task at a time since reading it is sequential,
+// parked while POOL_MAX_BATCHES of its batches are in flight. Write tasks assign
+// file offsets in batch order and pwrite whole batches. Up to max_files files
+// are in the pool at once, so one file's I/O overlaps the others' transforms;
+// the task that writes a file's last batch commits it and opens the next file.
+const char *stage_name(Stage stage) {
+    return stage == STAGE_READ ? "read" : stage == STAGE_WRITE ? "write" : stage_groups[stage - 1].name;
+}
+
+// Cache-line aligned, like its lines in the arena, so the workers handling
+// two batches never write to the same cache line
+struct Batch {
+    FileJob *file;
+    long index;                 // Batch number in file order
+    Line *lines[BATCH_LINES];
+    int count;
+    size_t bytes;               // Output size: the lines plus their newlines
+    off_t offset;               // Where the batch goes in the output file
+} __attribute__((aligned(64)));
+
+typedef struct {
+    FileJob *file;
+    Batch *batch;               // NULL for a read task
+    Stage stage;
+} Task;
+
+typedef struct {
+    Task *tasks;                // Room for every task that can exist at once
+    long top;                   // Oldest task, taken by thieves
+    long bottom;                // One past the newest task, used by the owner
+    pthread_mutex_t mutex;
+} TaskDeque;
+
+typedef struct {
+    int id;
+    double busy[STAGE_SLOTS];   // Seconds spent running tasks of each stage
+    long tasks[STAGE_SLOTS];
+    long steals;
+} PoolWorker;
+
+TaskDeque *deques;
+long deque_capacity;
+PoolWorker *pool_workers;
+int pool_size;
+int pool_load;                  // Load each file before reading it into batches
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the counters below and the files' counters
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;    // Signaled when a task is pushed or the run is over
+int pending_tasks = 0;          // Tasks sitting in any deque
+int files_in_flight = 0;        // Files opened and not yet committed, plus slots still being filled
+int files_failed = 0;
+int pool_done = 0;
+
+double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void pool_push(int worker, FileJob *file, Batch *batch, Stage stage) {
+    TaskDeque *deque = &deques[worker];
+    metered_lock(&deque->mutex, WAIT_POOL_LOCK);
+    deque->tasks[deque->bottom % deque_capacity] = (Task){ file, batch, stage };
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->mutex);
+
+    metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+    pending_tasks++;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Pop from the worker's own deque, else steal from the others. Returns 0 if nothing was found.
+int pool_take(int worker, Task *task) {
+    int found = 0;
+    for (int i = 0; i < pool_size && !found; i++) {
+        TaskDeque *deque = &deques[(worker + i) % pool_size];
+        metered_lock(&deque->mutex, WAIT_POOL_LOCK);
+        if (deque->bottom > deque->top) {
+            if (i == 0) {
+                *task = deque->tasks[--deque->bottom % deque_capacity];
+            } else {
+                *task = deque->tasks[deque->top++ % deque_capacity];
+                pool_workers[worker].steals++;
+            }
+            found = 1;
+        }
+        pthread_mutex_unlock(&deque->mutex);
+    }
+    if (found) {
+        metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+        pending_tasks--;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return found;
+}
+
+// Fill a file slot with the next file from the source, or give the slot up.
+// The run is over once every slot has been given up.
+void pool_next_file(int worker) {
+    FileJob *file = NULL;
+    char *path;
+    while (!file && (path = source_next())) {
+        file = file_open(path, pool_load);
+        free(path);
+        if (!file) {
+            metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+            files_failed++;
+            pthread_mutex_unlock(&pool_mutex);
+        }
+    }
+    if (file) {
+        pool_push(worker, file, NULL, STAGE_READ);
+        return;
+    }
+    metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+    if (--files_in_flight == 0) {
+        pool_done = 1;
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Called once the file's last batch is written
+void pool_file_done(PoolWorker *worker, FileJob *file) {
+    if (file_commit(file) != 0) {
+        metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+        files_failed++;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    pool_next_file(worker->id - 1);
+}
+
+void run_read_task(PoolWorker *worker, FileJob *file) {
+    Batch *batch = aligned_alloc(64, sizeof(Batch));
+    batch->file = file;
+    batch->count = 0;
+    batch->bytes = 0;
+    Line *line;
+    long bytes = 0;
+    while (batch->count < BATCH_LINES && (line = take_line(file))) {
+        trace(TRACE_READ, worker->id, line->index, line->text, line->length);
+        batch->lines[batch->count++] = line;
+        bytes += line->length;
+    }
+    metric_stage(STAGE_READ, batch->count, bytes, 0);
+
+    metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+    int more = batch->count == BATCH_LINES;
+    int done = 0;
+    if (batch->count > 0) {
+        batch->index = file->next_batch_index++;
+        file->batches_in_flight++;
+    }
+    if (!more) {
+        file->reader_done = 1;
+        done = file->batches_in_flight == 0;
+    } else if (file->batches_in_flight >= POOL_MAX_BATCHES) {
+        file->read_parked = 1; // Resumed by the write task that brings the count down
+        more = 0;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (batch->count > 0) {
+        pool_push(worker->id - 1, file, batch, STAGE_READ + 1);
+    } else {
+        free(batch);
+    }
+    if (more) {
+        pool_push(worker->id - 1, file, NULL, STAGE_READ);
+    }
+    if (done) {
+        pool_file_done(worker, file); // Empty, or its batches were written before the read ended
+    }
+}
+
+void run_transform_task(PoolWorker *worker, Batch *batch, Stage stage) {
+    int g = stage - 1;
+    long bytes = 0;
+    for (int i = 0; i < batch->count; i++) {
+        Line *line = batch->lines[i];
+        trace(TRACE_GROUP + g, worker->id, line->index, line->text, line->length);
+        bytes += line->length;
+        group_apply(&stage_groups[g], line);
+    }
+    metric_stage(stage, batch->count, bytes, 0);
+    pool_push(worker->id - 1, batch->file, batch, stage + 1);
+}
+
+void run_write_task(PoolWorker *worker, Batch *batch) {
+    FileJob *file = batch->file;
+    for (int i = 0; i < batch->count; i++) {
+        batch->bytes += batch->lines[i]->length + 1;
+    }
+
+    // Park the batch; whoever completes the run in file order hands out the offsets
+    // and writes those batches
+    Batch *ready[POOL_MAX_BATCHES];
+    int ready_count = 0;
+    metered_lock(&output_mutex, WAIT_OUTPUT_LOCK);
+    file->batch_window[batch->index % POOL_MAX_BATCHES] = batch;
+    while ((batch = file->batch_window[file->next_offset_batch % POOL_MAX_BATCHES]) &&
+           batch->index == file->next_offset_batch) {
+        file->batch_window[file->next_offset_batch % POOL_MAX_BATCHES] = NULL;
+        batch->offset = file->output_offset;
+        file->output_offset += batch->bytes;
+        ready[ready_count++] = batch;
+        file->next_offset_batch++;
+    }
+    pthread_mutex_unlock(&output_mutex);
+
+    for (int b = 0; b < ready_count; b++) {
+        batch = ready[b];
+        char *buffer = io_buffer_alloc(batch->bytes);
+        size_t length = 0;
+        for (int i = 0; i < batch->count; i++) {
+            Line *line = batch->lines[i];
+            memcpy(buffer + length, line->text, line->length);
+            buffer[length + line->length] = '\n';
+            length += line->length + 1;
+            trace(TRACE_WRITE, worker->id, line->index, line->text, line->length);
+            metric_latency(line);
+            line_free(line);
+        }
+        metric_stage(STAGE_WRITE, batch->count, length, 0);
+        write_buffer(file, buffer, length, batch->offset);
+        free(batch);
+    }
+
+    if (ready_count > 0) {
+        metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+        file->batches_in_flight -= ready_count;
+        int resume = file->read_parked;
+        file->read_parked = 0;
+        int done = file->reader_done && file->batches_in_flight == 0;
+        pthread_mutex_unlock(&pool_mutex);
+        if (resume) {
+            pool_push(worker->id - 1, file, NULL, STAGE_READ);
+        }
+        if (done) {
+            pool_file_done(worker, file);
+        }
+    }
+}
+
+void *pool_thread(void *arg) {
+    PoolWorker *worker = arg;
+    while (1) {
+        current_stage = STAGE_IDLE;
+        metered_lock(&pool_mutex, WAIT_POOL_LOCK);
+        while (pending_tasks == 0 && !pool_done) {
+            metered_wait(&pool_cond, &pool_mutex, WAIT_INPUT);
+        }
+        int finished = pending_tasks == 0 && pool_done;
+        pthread_mutex_unlock(&pool_mutex);
+        if (finished) {
+            break;
+        }
+
+        Task task;
+        if (!pool_take(worker->id - 1, &task)) {
+            continue; // Another worker got there first
+        }
+        double start = seconds_now();
+        current_stage = task.stage;
+        if (task.stage == STAGE_READ) {
+            run_read_task(worker, task.file);
+        } else if (task.stage == STAGE_WRITE) {
+            run_write_task(worker, task.batch);
+        } else {
+            run_transform_task(worker, task.batch, task.stage);
+        }
+        double busy = seconds_now() - start;
+        worker->busy[task.stage] += busy;
+        metric_stage(task.stage, 0, 0, (long)(busy * 1e9));
+        worker->tasks[task.stage]++;
+    }
+    return NULL;
+}
+
+// Run every file of the source through worker_count pool threads, max_files at
+// a time, and report how busy each stage kept them. Returns the number of files
+// that could not be transformed.
+int run_pool(int worker_count, int max_files, int load) {
+    pool_size = worker_count;
+    pool_load = load;
+    deque_capacity = (long)max_files * (POOL_MAX_BATCHES + 1); // Every batch in flight plus the read tasks
+    deques = calloc(worker_count, sizeof(TaskDeque));
+    pool_workers = calloc(worker_count, sizeof(PoolWorker));
+    pthread_t threads[worker_count];
+    for (int i = 0; i < worker_count; i++) {
+        deques[i].tasks = malloc(deque_capacity * sizeof(Task));
+        pthread_mutex_init(&deques[i].mutex, NULL);
+        pool_workers[i].id = i + 1;
+    }
+
+    double start = seconds_now();
+    files_in_flight = max_files;
+    for (int i = 0; i < max_files && !pool_done; i++) {
+        pool_next_file(i % worker_count);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_create(&threads[i], NULL, pool_thread, &pool_workers[i]);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = seconds_now() - start;
+    for (int i = 0; i < worker_count; i++) {
+        free(deques[i].tasks);
+        pthread_mutex_destroy(&deques[i].mutex);
+    }
+    if (verbosity == VERBOSITY_OFF) {
+        free(deques);
+        free(pool_workers);
+        return files_failed;
+    }
+
+    // Share of the pool's total thread time each stage used
+    long steals = 0;
+    double idle = elapsed * worker_count;
+    fprintf(stderr, "Pool: %d workers, %.3f s\n", worker_count, elapsed);
+    for (int s = STAGE_READ; s <= STAGE_WRITE; s++) {
+        double busy = 0;
+        long tasks = 0;
+        for (int i = 0; i < worker_count; i++) {
+            busy += pool_workers[i].busy[s];
+            tasks += pool_workers[i].tasks[s];
+        }
+        idle -= busy;
+        fprintf(stderr, "  %-14s %8ld tasks %9.3f s busy %6.1f%%\n", stage_name(s), tasks, busy,
+                elapsed > 0 ? 100.0 * busy / (elapsed * worker_count) : 0);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        steals += pool_workers[i].steals;
+    }
+    fprintf(stderr, "  %-14s %8ld steals %8.3f s      %6.1f%%\n", "idle", steals, idle > 0 ? idle : 0,
+            elapsed > 0 && idle > 0 ? 100.0 * idle / (elapsed * worker_count) : 0);
+    free(deques);
+    free(pool_workers);
+    return files_failed;
+}
+
+// Memory-mapped mode. Byte-wise stages keep every byte's position, so the output
+// file is created at the input's size, mapped, and filled directly: workers claim
+// chunks of the input and convert them into the same range of the output. Chunk
+// boundaries are moved to just after a newline so no line is split between workers.
+typedef struct {
+    const char *input;
+    char *output;
+    size_t size;
+    long next_chunk;            // Next chunk number to claim
+    pthread_mutex_t mutex;
+} MappedFile;
+
+MappedFile mapped_file;
+
+// Offset just after the first newline at or after offset, or the end of the file
+size_t align_to_line(size_t offset) {
+    if (offset >= mapped_file.size) {
+        return mapped_file.size;
+    }
+    const char *newline = memchr(mapped_file.input + offset, '\n', mapped_file.size - offset);
+    return newline ? (size_t)(newline - mapped_file.input) + 1 : mapped_file.size;
+}
+
+void *mmap_worker(void *arg) {
+    int thread_id = *(int *)arg;
+    while (1) {
+        pthread_mutex_lock(&mapped_file.mutex);
+        long chunk = mapped_file.next_chunk++;
+        pthread_mutex_unlock(&mapped_file.mutex);
+
+        // Every worker computes the same boundaries, so the chunks never overlap
+        size_t start = chunk == 0 ? 0 : align_to_line((size_t)chunk * MMAP_CHUNK_SIZE);
+        if (start >= mapped_file.size) {
+            break;
+        }
+        size_t end = align_to_line((size_t)(chunk + 1) * MMAP_CHUNK_SIZE);
+        // The first group maps the chunk into the output, any later ones work in place there
+        for (int g = 0; g < group_count; g++) {
+            long started = metric_clock();
+            group_map_bytes(&stage_groups[g], g == 0 ? mapped_file.input + start : mapped_file.output + start,
+                            mapped_file.output + start, end - start);
+            metric_stage(STAGE_READ + 1 + g, 0, end - start, metric_clock() - started);
+        }
+        trace(TRACE_CHUNK, thread_id, start, NULL, end - start);
+    }
+    return NULL;
+}
+
+// Transform filename through a mapped temp file of the same size, then rename it
+int run_mmap(const char *filename, int worker_count) {
+    if (worker_count < 1) {
+        fprintf(stderr, "Error: -m needs at least one worker.\n");
+        return EXIT_FAILURE;
+    }
+    for (int g = 0; g < group_count; g++) {
+        if (!stage_groups[g].bytewise || stage_groups[g].table['\n'] != '\n') {
+            fprintf(stderr, "Error: -m only works with byte-wise stages such as upper, lower and replace.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    int input_fd = open(filename, O_RDONLY);
+    if (input_fd < 0) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_FAILURE;
+    int output_fd = -1;
+    char *temp_path = NULL;
+    mapped_file.input = MAP_FAILED;
+    mapped_file.output = MAP_FAILED;
+    struct stat st;
+    if (fstat(input_fd, &st) != 0) {
+        perror("Error reading file size");
+        goto cleanup;
+    }
+    output_fd = temp_create(filename, st.st_mode, &temp_path);
+    if (output_fd < 0) {
+        temp_path = NULL; // temp_create freed it
+        goto cleanup;
+    }
+    if (ftruncate(output_fd, st.st_size) != 0) {
+        perror("Error creating output file");
+        goto cleanup;
+    }
+
+    mapped_file.size = st.st_size;
+    mapped_file.next_chunk = 0;
+    if (mapped_file.size > 0) { // An empty file cannot be mapped and needs no work
+        mapped_file.input = mmap(NULL, mapped_file.size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+        mapped_file.output = mmap(NULL, mapped_file.size, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd, 0);
+        if (mapped_file.input == MAP_FAILED || mapped_file.output == MAP_FAILED) {
+            perror("Error mapping file");
+            goto cleanup;
+        }
+        madvise((void *)mapped_file.input, mapped_file.size, MADV_SEQUENTIAL);
+
+        pthread_mutex_init(&mapped_file.mutex, NULL);
+        pthread_t workers[worker_count];
+        int worker_ids[worker_count];
+        for (int i = 0; i < worker_count; i++) {
+            worker_ids[i] = i + 1;
+            pthread_create(&workers[i], NULL, mmap_worker, &worker_ids[i]);
+        }
+        for (int i = 0; i < worker_count; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        pthread_mutex_destroy(&mapped_file.mutex);
+
+        munmap((void *)mapped_file.input, mapped_file.size);
+        munmap(mapped_file.output, mapped_file.size);
+        mapped_file.input = mapped_file.output = MAP_FAILED;
+    }
+
+    // The other modes end every line with a newline, the last one included
+    char last = '\n';
+    if (st.st_size > 0 && (pread(input_fd, &last, 1, st.st_size - 1) != 1 ||
+                           (last != '\n' && pwrite(output_fd, "\n", 1, st.st_size) != 1))) {
+        perror("Error writing to file");
+        goto cleanup;
+    }
+
+    // The dirty pages of the shared mapping are written back here
+    if (fsync(output_fd) != 0) {
+        perror("Error syncing output file");
+        goto cleanup;
+    }
+    if (rename(temp_path, filename) != 0) {
+        perror("Error renaming output file");
+        goto cleanup;
+    }
+    status = 0;
+
+cleanup:
+    // Every path after the open ends here, so no temp file or descriptor is left behind
+    if (mapped_file.input != MAP_FAILED) {
+        munmap((void *)mapped_file.input, mapped_file.size);
+    }
+    if (mapped_file.output != MAP_FAILED) {
+        munmap(mapped_file.output, mapped_file.size);
+    }
+    if (output_fd >= 0) {
+        close(output_fd);
+    }
+    close(input_fd);
+    if (status != 0 && temp_path) {
+        unlink(temp_path);
+    }
+    free(temp_path);
+    return status;
+}
+
+// Tracing: see TraceRecord
+TraceRing **trace_rings = NULL;         // Every thread's ring, for the logger and the summary
+int trace_ring_count = 0;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;   // Protects the ring list
+__thread TraceRing *thread_ring = NULL; // This thread's ring, created on its first record
+pthread_t logger;
+int logger_running = 0;
+int logger_stop = 0;
+double trace_start_time;
+
+TraceRing *trace_ring_create(void) {
+    TraceRing *ring;
+    if (posix_memalign((void **)&ring, 64, sizeof(TraceRing)) != 0) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(ring, 0, sizeof(TraceRing));
+    if (verbosity == VERBOSITY_LINE) {
+        ring->records = malloc(TRACE_RING_SIZE * sizeof(TraceRecord));
+    }
+    pthread_mutex_lock(&trace_mutex);
+    trace_rings = realloc(trace_rings, (trace_ring_count + 1) * sizeof(TraceRing *));
+    trace_rings[trace_ring_count++] = ring;
+    pthread_mutex_unlock(&trace_mutex);
+    return ring;
+}
+
+// Record that thread_id did op on a line (text is the line before the operation)
+void trace(TraceOp op, int thread_id, long line, const char *text, size_t length) {
+    if (verbosity == VERBOSITY_OFF) {
+        return;
+    }
+    TraceRing *ring = thread_ring;
+    if (!ring) {
+        ring = thread_ring = trace_ring_create();
+    }
+    ring->counts[op][thread_id < 64 ? thread_id : 63]++;
+    if (verbosity != VERBOSITY_LINE) {
+        return;
+    }
+
+    // Wait for the logger if the ring is full rather than lose records
+    unsigned long head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        sched_yield();
+    }
+    TraceRecord *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->time = (uint64_t)((seconds_now() - trace_start_time) * 1e9);
+    record->line = line;
+    record->length = length;
+    record->thread = thread_id;
+    record->op = op;
+    if (text) {
+        memcpy(record->text, text, length < TRACE_TEXT ? length : TRACE_TEXT);
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Print one record the way the threads used to; long lines end in "..."
+void trace_format(FILE *out, TraceRecord *record) {
+    int shown = record->length < TRACE_TEXT ? record->length : TRACE_TEXT;
+    const char *more = record->length > TRACE_TEXT ? "..." : "";
+    int id = record->thread;
+    long number = record->line + 1;
+
+    switch (record->op) {
+    case TRACE_READ:
+        fprintf(out, "Read_%d Read_%d read the line %ld which is \"%.*s%s\"\n", id, id, number, shown, record->text, more);
+        break;
+    case TRACE_WRITE:
+        fprintf(out, "Writer_%d Writer_%d write line %ld back which is \"%.*s%s\"\n", id, id, number, shown, record->text, more);
+        break;
+    case TRACE_CHUNK:
+        fprintf(out, "Worker_%d Worker_%d converted bytes %ld-%ld\n", id, id, record->line, record->line + (long)record->length);
+        break;
+    default: {
+        // One message per stage of the group, replaying the stages on the saved text
+        StageGroup *group = &stage_groups[record->op - TRACE_GROUP];
+        size_t length = shown;
+        char *text = malloc(length + 1);
+        memcpy(text, record->text, length);
+        text[length] = '\0';
+        for (int s = group->first; s < group->first + group->count; s++) {
+            const char *name = stage_steps[s].label;
+            fprintf(out, "%s_%d %s_%d read index %ld and converted \"%.*s%s\" to \"", name, id, name, id, number,
+                    (int)length, text, more);
+            char *before = text;
+            length = step_apply(&stage_steps[s], &text, length);
+            if (text != before) {
+                free(before);
+            }
+            fprintf(out, "%.*s%s\"\n", (int)length, text, more);
+        }
+        free(text);
+        break;
+    }
+    }
+}
+
+// Format everything currently in the rings. Returns the number of records.
+long trace_drain(void) {
+    long drained = 0;
+    pthread_mutex_lock(&trace_mutex);
+    for (int i = 0; i < trace_ring_count; i++) {
+        TraceRing *ring = trace_rings[i];
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        for (; tail != head; tail++) {
+            trace_format(stdout, &ring->records[tail & (TRACE_RING_SIZE - 1)]);
+        }
+        drained += head - ring->tail;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    return drained;
+}
+
+void *logger_thread(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&logger_stop, __ATOMIC_ACQUIRE)) {
+        if (trace_drain() == 0) {
+            usleep(200); // Nothing new; the workers never wait on this thread unless a ring is full
+        }
+    }
+    trace_drain();
+    return NULL;
+}
+
+void trace_start(void) {
+    trace_start_time = seconds_now();
+    if (verbosity == VERBOSITY_LINE) {
+        static char stdout_buffer[1 << 16];
+        setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer)); // Only the logger writes to stdout
+        logger_running = pthread_create(&logger, NULL, logger_thread, NULL) == 0;
+    }
+}
+
+// Stop the logger after the workers are done, then print the summary
+void trace_stop(void) {
+    if (logger_running) {
+        __atomic_store_n(&logger_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(logger, NULL);
+        logger_running = 0;
+    }
+    if (verbosity == VERBOSITY_SUMMARY) {
+        // In pipeline order; every stage of a group handled the group's lines
+        for (int op = -1; op <= group_count; op++) {
+            TraceOp trace_op = op == -1 ? TRACE_READ : op < group_count ? TRACE_GROUP + op : TRACE_WRITE;
+            for (int id = 0; id < 64; id++) {
+                long count = 0;
+                for (int i = 0; i < trace_ring_count; i++) {
+                    count += trace_rings[i]->counts[trace_op][id];
                 }
-                // Write the line to the file
-                if (fprintf(file, "%s\n", lines[index]) < 0) {
-                    perror("Error writing to file"); // Handle write error
+                if (count == 0) {
+                    continue;
+                }
+                const char *suffix = id == 63 ? "+" : "";
+                if (trace_op == TRACE_READ) {
+                    printf("Read_%d%s %ld lines\n", id, suffix, count);
+                } else if (trace_op == TRACE_WRITE) {
+                    printf("Writer_%d%s %ld lines\n", id, suffix, count);
                 } else {
-                    // Print the write operation
-                    printf("Writer_%d Writer_%d write line %d back which is \"%s\"\n", 
-                           thread_id, thread_id, index + 1, lines[index]);
-                    fflush(file); // Flush the file buffer to ensure data is written
-                    line_status[index] = 4; // Mark the line as written
-                    pthread_mutex_lock(&processed_mutex); // Lock the processed mutex
-                    processed_lines++; // Increment the count of processed lines
-                    pthread_mutex_unlock(&processed_mutex); // Unlock the processed mutex
+                    for (int s = stage_groups[op].first; s < stage_groups[op].first + stage_groups[op].count; s++) {
+                        printf("%s_%d%s %ld lines\n", stage_steps[s].label, id, suffix, count);
+                    }
                 }
-                fclose(file); // Close the output file
-                processed = 1; // Set processed flag to indicate a line was processed
             }
-            pthread_mutex_unlock(&line_mutex[index]); // Unlock the mutex for the current line
         }
-        // Check if all lines have been processed
-        pthread_mutex_lock(&processed_mutex); // Lock the processed mutex
-        if (processed_lines >= total_lines) { // If all lines are processed
-            pthread_mutex_unlock(&processed_mutex); // Unlock the processed mutex
-            break; // Exit the loop
+        for (int id = 0; id < 64; id++) {
+            long chunks = 0;
+            for (int i = 0; i < trace_ring_count; i++) {
+                chunks += trace_rings[i]->counts[TRACE_CHUNK][id];
+            }
+            if (chunks > 0) {
+                printf("Worker_%d%s %ld chunks\n", id, id == 63 ? "+" : "", chunks);
+            }
         }
-        pthread_mutex_unlock(&processed_mutex); // Unlock the processed mutex
-        if (!processed) usleep(100); // If no lines were processed, wait briefly
     }
-    return NULL; 
+    fflush(stdout);
+    for (int i = 0; i < trace_ring_count; i++) {
+        free(trace_rings[i]->records);
+        free(trace_rings[i]);
+    }
+    free(trace_rings);
+    trace_rings = NULL;
+    trace_ring_count = 0;
+}
+
+// Metrics: see ThreadMetrics
+ThreadMetrics **metrics_list = NULL;    // Every thread's counters
+int metrics_count = 0;
+pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects the list
+__thread ThreadMetrics *thread_metrics = NULL;
+pthread_t sampler;
+int sampler_running = 0;
+int sampler_stop = 0;
+pthread_mutex_t sampler_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sampler_cond = PTHREAD_COND_INITIALIZER;     // Wakes the sampler at the end of the run
+long metrics_start_ns;
+
+long nanoseconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// The time in nanoseconds when metrics are on, 0 otherwise
+long metric_clock(void) {
+    return metrics_enabled ? nanoseconds_now() : 0;
+}
+
+ThreadMetrics *metrics_for_thread(void) {
+    if (!thread_metrics) {
+        thread_metrics = calloc(1, sizeof(ThreadMetrics));
+        if (!thread_metrics) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&metrics_mutex);
+        metrics_list = realloc(metrics_list, (metrics_count + 1) * sizeof(ThreadMetrics *));
+        metrics_list[metrics_count++] = thread_metrics;
+        pthread_mutex_unlock(&metrics_mutex);
+    }
+    return thread_metrics;
+}
+
+// Only the owning thread writes a counter, so this is a plain add that the
+// sampler can read at any time
+void metric_add(long *counter, long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+long metric_read(long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metric_stage(Stage stage, long lines, long bytes, long busy_ns) {
+    if (!metrics_enabled) {
+        return;
+    }
+    ThreadMetrics *metrics = metrics_for_thread();
+    metric_add(&metrics->lines[stage], lines);
+    metric_add(&metrics->bytes[stage], bytes);
+    metric_add(&metrics->busy_ns[stage], busy_ns);
+}
+
+// Called as a line is written, for the time since it was read
+void metric_latency(Line *line) {
+    if (!metrics_enabled) {
+        return;
+    }
+    ThreadMetrics *metrics = metrics_for_thread();
+    long latency = nanoseconds_now() - line->read_ns;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latency >= 2L << bucket) {
+        bucket++;
+    }
+    metric_add(&metrics->latency[bucket], 1);
+    metric_add(&metrics->latency_ns, latency);
+    if (latency > metrics->latency_max_ns) {
+        __atomic_store_n(&metrics->latency_max_ns, latency, __ATOMIC_RELAXED);
+    }
+}
+
+void metric_wait(WaitKind kind, long start) {
+    ThreadMetrics *metrics = metrics_for_thread();
+    metric_add(&metrics->wait_ns[current_stage][kind], nanoseconds_now() - start);
+    metric_add(&metrics->waits[current_stage][kind], 1);
+}
+
+// pthread_mutex_lock that times the wait when the mutex is taken
+void metered_lock(pthread_mutex_t *mutex, WaitKind kind) {
+    if (!metrics_enabled) {
+        pthread_mutex_lock(mutex);
+        return;
+    }
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+    long start = nanoseconds_now();
+    pthread_mutex_lock(mutex);
+    metric_wait(kind, start);
+}
+
+void metered_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, WaitKind kind) {
+    long start = metric_clock();
+    pthread_cond_wait(cond, mutex);
+    if (metrics_enabled) {
+        metric_wait(kind, start);
+    }
+}
+
+// Everything the threads have counted so far
+void metrics_total(ThreadMetrics *total) {
+    memset(total, 0, sizeof(ThreadMetrics));
+    pthread_mutex_lock(&metrics_mutex);
+    for (int i = 0; i < metrics_count; i++) {
+        ThreadMetrics *metrics = metrics_list[i];
+        for (int s = 0; s <= STAGE_IDLE; s++) {
+            total->lines[s] += metric_read(&metrics->lines[s]);
+            total->bytes[s] += metric_read(&metrics->bytes[s]);
+            total->busy_ns[s] += metric_read(&metrics->busy_ns[s]);
+            for (int k = 0; k < WAIT_KINDS; k++) {
+                total->wait_ns[s][k] += metric_read(&metrics->wait_ns[s][k]);
+                total->waits[s][k] += metric_read(&metrics->waits[s][k]);
+            }
+        }
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            total->latency[b] += metric_read(&metrics->latency[b]);
+        }
+        total->latency_ns += metric_read(&metrics->latency_ns);
+        long max = metric_read(&metrics->latency_max_ns);
+        if (max > total->latency_max_ns) {
+            total->latency_max_ns = max;
+        }
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+}
+
+// Upper bound in microseconds of the bucket holding the given percentile of the histogram
+double latency_percentile(long *histogram, double percent) {
+    long count = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        count += histogram[b];
+    }
+    long rank = (long)(percent / 100 * count + 0.5), seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen >= rank && seen > 0) {
+            return (2L << b) / 1e3;
+        }
+    }
+    return 0;
+}
+
+// Print the rates since the previous sample to stderr every sample_interval seconds
+void *sampler_thread(void *arg) {
+    (void)arg;
+    ThreadMetrics *previous = calloc(1, sizeof(ThreadMetrics));
+    ThreadMetrics *current = malloc(sizeof(ThreadMetrics));
+    long previous_ns = metrics_start_ns;
+    pthread_mutex_lock(&sampler_mutex);
+    while (!sampler_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long wake = deadline.tv_nsec + (long)(sample_interval * 1e9);
+        deadline.tv_sec += wake / 1000000000L;
+        deadline.tv_nsec = wake % 1000000000L;
+        pthread_cond_timedwait(&sampler_cond, &sampler_mutex, &deadline);
+        if (sampler_stop) {
+            break;
+        }
+
+        metrics_total(current);
+        long now = nanoseconds_now();
+        double seconds = (now - previous_ns) / 1e9;
+        fprintf(stderr, "[%7.1f s]", (now - metrics_start_ns) / 1e9);
+        for (int s = STAGE_READ; s <= STAGE_WRITE; s++) {
+            fprintf(stderr, " %s %.0f lines/s %.1f MB/s |", stage_name(s),
+                    (current->lines[s] - previous->lines[s]) / seconds,
+                    (current->bytes[s] - previous->bytes[s]) / seconds / 1e6);
+        }
+        long interval[LATENCY_BUCKETS];
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            interval[b] = current->latency[b] - previous->latency[b];
+        }
+        fprintf(stderr, " latency p50 %.0f us p99 %.0f us\n", latency_percentile(interval, 50), latency_percentile(interval, 99));
+        ThreadMetrics *swap = previous;
+        previous = current;
+        current = swap;
+        previous_ns = now;
+    }
+    pthread_mutex_unlock(&sampler_mutex);
+    free(previous);
+    free(current);
+    return NULL;
+}
+
+void metrics_start(void) {
+    metrics_start_ns = nanoseconds_now();
+    if (metrics_enabled && sample_interval > 0) {
+        sampler_running = pthread_create(&sampler, NULL, sampler_thread, NULL) == 0;
+    }
+}
+
+// Write one JSON object with the totals of the run
+void metrics_write(FILE *out, const char *mode, int threads, double elapsed) {
+    ThreadMetrics *total = malloc(sizeof(ThreadMetrics));
+    metrics_total(total);
+    fprintf(out, "{\"mode\":\"%s\",\"threads\":%d,\"kernel\":\"%s\",\"io\":\"%s\",\"elapsed_s\":%.6f,\"stages\":[",
+            mode, threads, transform_impl_name, uring_active ? "uring" : "sync", elapsed);
+    for (int s = STAGE_READ; s <= STAGE_WRITE + 1; s++) {
+        Stage stage = s <= STAGE_WRITE ? s : STAGE_IDLE; // The last entry is the pool between tasks
+        if (stage == STAGE_IDLE && strcmp(mode, "pool") != 0) {
+            break;
+        }
+        fprintf(out, "%s{\"name\":\"%s\",\"lines\":%ld,\"bytes\":%ld,\"busy_s\":%.6f,"
+                "\"lines_per_s\":%.1f,\"bytes_per_s\":%.1f,\"waits\":{",
+                s > STAGE_READ ? "," : "", stage == STAGE_IDLE ? "pool" : stage_name(stage), total->lines[stage],
+                total->bytes[stage], total->busy_ns[stage] / 1e9, elapsed > 0 ? total->lines[stage] / elapsed : 0,
+                elapsed > 0 ? total->bytes[stage] / elapsed : 0);
+        for (int k = 0; k < WAIT_KINDS; k++) {
+            fprintf(out, "%s\"%s\":{\"count\":%ld,\"s\":%.6f}", k > 0 ? "," : "", wait_names[k], total->waits[stage][k],
+                    total->wait_ns[stage][k] / 1e9);
+        }
+        fprintf(out, "}}");
+    }
+    long written = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        written += total->latency[b];
+    }
+    // Percentiles are bucket bounds, so the largest ones can exceed the real maximum
+    double max = total->latency_max_ns / 1e3;
+    double p50 = latency_percentile(total->latency, 50);
+    double p90 = latency_percentile(total->latency, 90);
+    double p99 = latency_percentile(total->latency, 99);
+    fprintf(out, "],\"latency_us\":{\"count\":%ld,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f,\"histogram\":[",
+            written, written > 0 ? total->latency_ns / 1e3 / written : 0, p50 < max ? p50 : max, p90 < max ? p90 : max,
+            p99 < max ? p99 : max, max);
+    int first = 1;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        if (total->latency[b] > 0) {
+            fprintf(out, "%s{\"le_us\":%.3f,\"count\":%ld}", first ? "" : ",", (2L << b) / 1e3, total->latency[b]);
+            first = 0;
+        }
+    }
+    fprintf(out, "]}}\n");
+    free(total);
 }
 
-// Function to remove the newline character from a line and return a copy
-char *remove_newline_copy(const char *line) {
-    size_t len = strlen(line); // Get the length of the line
-    char *temp_line = malloc(len + 1); // Allocate memory for the new line (including null terminator)
-    if (!temp_line) {
-        perror("Memory allocation failed"); // Handle memory allocation error
-        exit(EXIT_FAILURE); // Exit the program on failure
+// Stop the sampler and write the report once the workers are done
+void metrics_stop(const char *mode, int threads) {
+    if (!metrics_enabled) {
+        return;
     }
-    strcpy(temp_line, line); // Copy the original line to the new memory
-    // Check if the last character is a newline and remove it
-    if (len > 0 && temp_line[len - 1] == '\n') { 
-        temp_line[len - 1] = '\0'; // Replace newline with null terminator
+    double elapsed = (nanoseconds_now() - metrics_start_ns) / 1e9;
+    if (sampler_running) {
+        pthread_mutex_lock(&sampler_mutex);
+        sampler_stop = 1;
+        pthread_cond_signal(&sampler_cond);
+        pthread_mutex_unlock(&sampler_mutex);
+        pthread_join(sampler, NULL);
+        sampler_running = 0;
+    }
+    if (metrics_path) {
+        FILE *out = strcmp(metrics_path, "-") == 0 ? stdout : fopen(metrics_path, "w");
+        if (!out) {
+            perror("Error opening metrics file");
+        } else {
+            metrics_write(out, mode, threads, elapsed);
+            if (out == stdout) {
+                fflush(out);
+            } else {
+                fclose(out);
+            }
+        }
+    }
+    for (int i = 0; i < metrics_count; i++) {
+        free(metrics_list[i]);
+    }
+    free(metrics_list);
+    metrics_list = NULL;
+    metrics_count = 0;
+}
+
+// io_uring backend: see UringRequest
+int uring_enter(unsigned submit, unsigned wait) {
+    int rc;
+    do {
+        rc = syscall(__NR_io_uring_enter, uring.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+    return rc;
+}
+
+// Reap completions until uring_stop's NOP comes back
+void *uring_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        unsigned head = *uring.cq_head;
+        if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            if (uring_enter(0, 1) < 0) {
+                perror("Error waiting for io_uring");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        UringRequest *request = (UringRequest *)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+        if (!request) {
+            break;
+        }
+        // The kernel hands the request over, but taking the lock makes the
+        // submitter's writes to it visible in terms of the memory model too
+        pthread_mutex_lock(&uring_mutex);
+        FileJob *file = request->file;  // Set for writes
+        pthread_mutex_unlock(&uring_mutex);
+        if (file) {
+            if (result < 0) {
+                errno = -result;
+                perror("Error writing to file");
+                exit(EXIT_FAILURE);
+            }
+            // Rare for regular files; finish it here rather than resubmit
+            pwrite_all(request->fd, request->buffer + result, request->length - result, request->offset + result);
+        }
+        pthread_mutex_lock(&uring_mutex);
+        uring_in_flight--;
+        if (file) {
+            file->writes_pending--;
+        } else {
+            request->result = result;
+            request->done = 1;          // The reader may free it from here on
+        }
+        pthread_cond_broadcast(&uring_cond);
+        pthread_mutex_unlock(&uring_mutex);
+        if (file) {
+            io_buffer_free(request->buffer);
+            free(request);
+        }
+    }
+    return NULL;
+}
+
+// Set up the ring, register the buffer pool and start the completion thread.
+// Returns -1 after printing why if the kernel does not provide io_uring.
+int uring_start(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)) { // Older kernels lack IORING_OP_READ/WRITE
+        fprintf(stderr, "io_uring unavailable (%s), using read and pwrite\n", fd < 0 ? strerror(errno) : "kernel too old");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = single_mmap || sq == MAP_FAILED ? sq :
+               mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = sq == MAP_FAILED || cq == MAP_FAILED ? MAP_FAILED :
+                 mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        fprintf(stderr, "io_uring unavailable (%s), using read and pwrite\n", strerror(errno));
+        close(fd); // Also unmaps the rings
+        return -1;
+    }
+    uring.fd = fd;
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.sqes = sqes;
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Without the buffer pool (e.g. over RLIMIT_MEMLOCK) every request uses malloc memory
+    struct iovec iov[URING_BUFFERS];
+    uring_buffers = aligned_alloc(4096, (size_t)URING_BUFFERS * OUTPUT_BUFFER_SIZE);
+    for (int i = 0; uring_buffers && i < URING_BUFFERS; i++) {
+        iov[i].iov_base = uring_buffers + (size_t)i * OUTPUT_BUFFER_SIZE;
+        iov[i].iov_len = OUTPUT_BUFFER_SIZE;
+        uring_free_slots[i] = URING_BUFFERS - 1 - i;
+    }
+    if (uring_buffers && syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0) {
+        uring_free_count = URING_BUFFERS;
+    } else {
+        free(uring_buffers);
+        uring_buffers = NULL;
+    }
+    if (pthread_create(&uring_completer, NULL, uring_thread, NULL) != 0) {
+        fprintf(stderr, "io_uring unavailable (no completion thread), using read and pwrite\n");
+        close(fd);
+        return -1;
+    }
+    uring_active = 1;
+    return 0;
+}
+
+// Stop the completion thread once every request is done
+void uring_stop(void) {
+    if (!uring_active) {
+        return;
+    }
+    uring_submit(NULL);
+    pthread_join(uring_completer, NULL);
+    close(uring.fd);
+    uring_active = 0;
+}
+
+// Queue a request (NULL for the NOP that stops uring_thread) and submit it.
+// Blocks while URING_ENTRIES requests are in flight.
+void uring_submit(UringRequest *request) {
+    metered_lock(&uring_mutex, WAIT_IO_LOCK);
+    while (uring_in_flight == URING_ENTRIES) {
+        metered_wait(&uring_cond, &uring_mutex, WAIT_IO);
+    }
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = (uintptr_t)request;
+    if (request) {
+        int slot = uring_buffers && request->buffer >= uring_buffers &&
+                   request->buffer < uring_buffers + (size_t)URING_BUFFERS * OUTPUT_BUFFER_SIZE ?
+                   (int)((request->buffer - uring_buffers) / OUTPUT_BUFFER_SIZE) : -1;
+        if (slot >= 0) {
+            request->op = request->op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = slot;
+        }
+        sqe->opcode = request->op;
+        sqe->fd = request->fd;
+        sqe->addr = (uintptr_t)request->buffer;
+        sqe->len = request->length;
+        sqe->off = request->offset;
+        if (request->file) {
+            request->file->writes_pending++;
+        }
+    }
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring_in_flight++;
+    pthread_mutex_unlock(&uring_mutex);
+    // Each call submits at most one entry, so every entry queued is submitted by someone
+    if (uring_enter(1, 0) < 0) {
+        perror("Error submitting to io_uring");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Block until a read is done
+void uring_wait(UringRequest *request) {
+    metered_lock(&uring_mutex, WAIT_IO_LOCK);
+    while (!request->done) {
+        metered_wait(&uring_cond, &uring_mutex, WAIT_IO);
+    }
+    pthread_mutex_unlock(&uring_mutex);
+}
+
+// Block until every write submitted for the file is done
+void uring_wait_writes(FileJob *file) {
+    if (!uring_active) {
+        return;
+    }
+    metered_lock(&uring_mutex, WAIT_IO_LOCK);
+    while (file->writes_pending > 0) {
+        metered_wait(&uring_cond, &uring_mutex, WAIT_IO);
+    }
+    pthread_mutex_unlock(&uring_mutex);
+}
+
+// Wait for a read nobody needs any more and free it
+void uring_discard(UringRequest *request) {
+    uring_wait(request);
+    io_buffer_free(request->buffer);
+    free(request);
+}
+
+// A buffer for a read or write of up to size bytes: a registered one when it
+// fits and one is free, else malloc memory. Free it with io_buffer_free.
+char *io_buffer_alloc(size_t size) {
+    char *buffer = NULL;
+    if (uring_buffers && size <= OUTPUT_BUFFER_SIZE) {
+        metered_lock(&uring_mutex, WAIT_IO_LOCK);
+        if (uring_free_count > 0) {
+            buffer = uring_buffers + (size_t)uring_free_slots[--uring_free_count] * OUTPUT_BUFFER_SIZE;
+        }
+        pthread_mutex_unlock(&uring_mutex);
+    }
+    if (!buffer && !(buffer = malloc(size > 0 ? size : 1))) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+void io_buffer_free(char *buffer) {
+    if (uring_buffers && buffer >= uring_buffers && buffer < uring_buffers + (size_t)URING_BUFFERS * OUTPUT_BUFFER_SIZE) {
+        pthread_mutex_lock(&uring_mutex);
+        uring_free_slots[uring_free_count++] = (buffer - uring_buffers) / OUTPUT_BUFFER_SIZE;
+        pthread_mutex_unlock(&uring_mutex);
+    } else {
+        free(buffer);
+    }
+}
+
+// read() for the line reader. With io_uring the next URING_READ_AHEAD chunks
+// of the file are kept requested, and this copies out of the oldest one.
+ssize_t reader_read(LineReader *reader, char *buffer, size_t size) {
+    if (!reader->uring) {
+        return read(reader->fd, buffer, size);
+    }
+    while (reader->ahead_count < URING_READ_AHEAD) {
+        UringRequest *request = calloc(1, sizeof(UringRequest));
+        request->op = IORING_OP_READ;
+        request->fd = reader->fd;
+        request->buffer = io_buffer_alloc(OUTPUT_BUFFER_SIZE);
+        request->length = OUTPUT_BUFFER_SIZE;
+        request->offset = reader->offset;
+        reader->offset += OUTPUT_BUFFER_SIZE;
+        reader->ahead[(reader->ahead_head + reader->ahead_count++) % URING_READ_AHEAD] = request;
+        uring_submit(request);
+    }
+    UringRequest *request = reader->ahead[reader->ahead_head];
+    uring_wait(request);
+    if (request->result < 0) {
+        errno = -request->result;
+        return -1;
+    }
+    size_t n = request->result - request->consumed;
+    if (n > size) {
+        n = size;
+    }
+    memcpy(buffer, request->buffer + request->consumed, n);
+    request->consumed += n;
+    if (request->consumed == (size_t)request->result) {
+        reader->ahead_head = (reader->ahead_head + 1) % URING_READ_AHEAD;
+        reader->ahead_count--;
+        if ((size_t)request->result < request->length) {
+            // End of file, or a short read: the later requests start at the wrong
+            // offset, so drop them and ask again from here next time
+            while (reader->ahead_count > 0) {
+                uring_discard(reader->ahead[reader->ahead_head]);
+                reader->ahead_head = (reader->ahead_head + 1) % URING_READ_AHEAD;
+                reader->ahead_count--;
+            }
+            reader->offset = request->offset + request->result;
+        }
+        io_buffer_free(request->buffer);
+        free(request);
     }
-    return temp_line; // Return the modified line
+    return n;
 }
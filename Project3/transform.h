@@ -0,0 +1,185 @@
+// transform.h - byte transforms shared by the project3 stages
+//
+// transform_bytes() uppercases and/or replaces spaces with underscores in one
+// pass. On x86 it processes 64, 32 or 16 bytes at a time with AVX-512BW, AVX2
+// or SSE2, picked at run time from what the CPU supports. The scalar loop
+// handles the tail and other architectures. Bytes >= 0x80 are left alone by
+// the vector code unless the current locale uppercases some of them. In that
+// case every vector holding such a byte goes through toupper() instead.
+//
+// Header only; include it from one translation unit per program.
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANSFORM_X86 1
+#endif
+
+#define TRANSFORM_UPPER 1       // a-z -> A-Z (toupper() for the locale's other letters)
+#define TRANSFORM_REPLACE 2     // ' ' -> '_'
+
+typedef void (*transform_fn)(const char *input, char *output, size_t length, int flags);
+
+static int transform_high_letters = -1;     // 1 if toupper() changes any byte >= 0x80
+
+static void transform_scalar(const char *input, char *output, size_t length, int flags) {
+    int upper = flags & TRANSFORM_UPPER;
+    int replace = flags & TRANSFORM_REPLACE;
+    if (upper && transform_high_letters) {
+        for (size_t i = 0; i < length; i++) {
+            int c = toupper((unsigned char)input[i]);
+            output[i] = (char)(replace && c == ' ' ? '_' : c);
+        }
+        return;
+    }
+    // ASCII only: branch-free, so the compiler can vectorize it too
+    unsigned char case_bit = upper ? 'a' - 'A' : 0;
+    unsigned char underscore = replace ? '_' : ' ';
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = input[i];
+        c -= (unsigned char)(c - 'a') < 26 ? case_bit : 0;
+        output[i] = (char)(c == ' ' ? underscore : c);
+    }
+}
+
+#ifdef TRANSFORM_X86
+__attribute__((target("sse2")))
+static void transform_sse2(const char *input, char *output, size_t length, int flags) {
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i space_to_underscore = _mm_set1_epi8(' ' ^ '_');
+    const __m128i upper_on = _mm_set1_epi8((flags & TRANSFORM_UPPER) ? -1 : 0);
+    const __m128i replace_on = _mm_set1_epi8((flags & TRANSFORM_REPLACE) ? -1 : 0);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+        if (transform_high_letters && _mm_movemask_epi8(v)) {
+            transform_scalar(input + i, output + i, 16, flags);
+            continue;
+        }
+        // Bytes >= 0x80 compare as negative, so they never look like a-z
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmpgt_epi8(after_z, v));
+        v = _mm_xor_si128(v, _mm_and_si128(_mm_and_si128(lower, upper_on), case_bit));
+        __m128i spaces = _mm_and_si128(_mm_cmpeq_epi8(v, space), replace_on);
+        v = _mm_xor_si128(v, _mm_and_si128(spaces, space_to_underscore));
+        _mm_storeu_si128((__m128i *)(output + i), v);
+    }
+    transform_scalar(input + i, output + i, length - i, flags);
+}
+
+__attribute__((target("avx2")))
+static void transform_avx2(const char *input, char *output, size_t length, int flags) {
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i space_to_underscore = _mm256_set1_epi8(' ' ^ '_');
+    const __m256i upper_on = _mm256_set1_epi8((flags & TRANSFORM_UPPER) ? -1 : 0);
+    const __m256i replace_on = _mm256_set1_epi8((flags & TRANSFORM_REPLACE) ? -1 : 0);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(input + i));
+        if (transform_high_letters && _mm256_movemask_epi8(v)) {
+            transform_scalar(input + i, output + i, 32, flags);
+            continue;
+        }
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a), _mm256_cmpgt_epi8(after_z, v));
+        v = _mm256_xor_si256(v, _mm256_and_si256(_mm256_and_si256(lower, upper_on), case_bit));
+        __m256i spaces = _mm256_and_si256(_mm256_cmpeq_epi8(v, space), replace_on);
+        v = _mm256_xor_si256(v, _mm256_and_si256(spaces, space_to_underscore));
+        _mm256_storeu_si256((__m256i *)(output + i), v);
+    }
+    transform_sse2(input + i, output + i, length - i, flags);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void transform_avx512(const char *input, char *output, size_t length, int flags) {
+    const __m512i a = _mm512_set1_epi8('a');
+    const __m512i letters = _mm512_set1_epi8(26);
+    const __m512i case_bit = _mm512_set1_epi8(0x20);
+    const __m512i space = _mm512_set1_epi8(' ');
+    const __m512i underscore = _mm512_set1_epi8('_');
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(input + i));
+        if (transform_high_letters && _mm512_movepi8_mask(v)) {
+            transform_scalar(input + i, output + i, 64, flags);
+            continue;
+        }
+        if (flags & TRANSFORM_UPPER) {
+            __mmask64 lower = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(v, a), letters);
+            v = _mm512_mask_sub_epi8(v, lower, v, case_bit);
+        }
+        if (flags & TRANSFORM_REPLACE) {
+            v = _mm512_mask_mov_epi8(v, _mm512_cmpeq_epi8_mask(v, space), underscore);
+        }
+        _mm512_storeu_si512((void *)(output + i), v);
+    }
+    transform_avx2(input + i, output + i, length - i, flags);
+}
+#endif
+
+// Check whether the locale uppercases any byte the vector code would skip
+static void transform_check_locale(void) {
+    int high = 0;
+    for (int c = 0x80; c <= 0xff; c++) {
+        if (toupper(c) != c) {
+            high = 1;
+            break;
+        }
+    }
+    __atomic_store_n(&transform_high_letters, high, __ATOMIC_RELAXED);
+}
+
+static transform_fn transform_impl = NULL;
+static const char *transform_impl_name = "scalar";
+
+// Pick an implementation by name ("scalar", "sse2", "avx2", "avx512") or, for NULL,
+// the widest one the CPU supports. Returns -1 if the named one is unavailable.
+static int transform_select(const char *name) {
+    transform_fn impl = transform_scalar;
+    const char *impl_name = "scalar";
+#ifdef TRANSFORM_X86
+    __builtin_cpu_init();
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (name ? strcmp(name, "avx512") == 0 && has_avx512 : has_avx512) {
+        impl = transform_avx512, impl_name = "avx512";
+    } else if (name ? strcmp(name, "avx2") == 0 && has_avx2 : has_avx2) {
+        impl = transform_avx2, impl_name = "avx2";
+    } else if (name ? strcmp(name, "sse2") == 0 && has_sse2 : has_sse2) {
+        impl = transform_sse2, impl_name = "sse2";
+    }
+#endif
+    if (name && strcmp(name, impl_name) != 0) {
+        return -1;
+    }
+    transform_check_locale();
+    transform_impl_name = impl_name;
+    __atomic_store_n(&transform_impl, impl, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Apply flags to length bytes; input and output may be the same buffer
+static inline void transform_bytes(const char *input, char *output, size_t length, int flags) {
+    transform_fn impl = __atomic_load_n(&transform_impl, __ATOMIC_ACQUIRE);
+    if (!impl) {
+        transform_select(NULL);
+        impl = transform_impl;
+    }
+    impl(input, output, length, flags);
+}
+
+#endif